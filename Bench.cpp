@@ -0,0 +1,362 @@
+// Microbenchmarks of the simulation's hot paths, built by make bench
+//
+// usage: Bench.o [-o file]             run them all, results as CSV
+//        Bench.o compare old new       compare two results
+//
+// Results are one line per benchmark: name, operations, ns per operation.
+// Everything is seeded the same on every run and each benchmark is the
+// best of BENCHREPEATS runs, so two results of one build differ only by
+// timing noise.
+
+#define NOMAIN
+#include "Simulation.cpp"
+
+#define BENCHREPEATS 5
+
+// **************************************************************** //
+//                    Classes and structures
+// **************************************************************** //
+
+struct benchResult {
+  std::string name;
+  long long ops;
+  double ns;  // per operation
+};
+
+// time since start in seconds
+double since(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+// a Soup writing nowhere, with no Machines
+struct benchSoup {
+  std::ostream nowhere;
+  Reporter out;
+  Soup soup;
+
+  benchSoup(int size, const Config& c = cfg) : nowhere(NULL), 
+                                               out(nowhere, 0, c),
+                                               soup(size, out, c) {
+    soup.step = 0;
+  }
+  // a Machine at loc of size len, owning its memory, at the end of the
+  // queue, as a birth would leave it
+  Machine* add(int loc, int len) {
+    Machine* m = soup.machines->alloc(loc, len);
+    if (m == NULL) return NULL;
+    m->seed(soup.rng.next64(), soup.cfg);
+    soup.CPUs->enqueue(m);
+    soup.memAlloc(loc, len, m);
+    soup.recordBirth(m, NULL);
+    return m;
+  }
+};
+
+// **************************************************************** //
+// Interpreter: one Machine running a loop of one class of instruction
+// ns per instruction executed
+
+#define BENCHPROGRAM 40
+
+struct benchProgram {
+  const char* name;
+  signed char code[BENCHPROGRAM];
+};
+
+// each loop leaves the stacks as it found them
+// (exec_memory writes past the end of its loop)
+benchProgram programs[] = {
+  { "exec_stack",
+    { DO, PUSH, 1, POP, PUSH, 2, POP, PUSH, 3, POP, LOOP } },
+  { "exec_arith",
+    { DO, PUSH, 3, INC, DEC, PUSH, 4, PUSH, ADD, ALU, POP, LOOP } },
+  { "exec_regs",
+    { DO, PUSH, 5, PUSH, 1, STORE, PUSH, 1, LOAD, POP, RAND, POP, LOOP } },
+  { "exec_memory",
+    { DO, PUSH, 20, READ, POP, PUSH, 7, PUSH, 30, WRITE, POP,
+      PUSH, 20, PUSH, 31, COPY, POP, LOOP } },
+  { "exec_control",
+    { DO, PUSH, 1, SLTZ, NOP, PUSH, 0, SEZ, NOP, LOOP } }
+};
+
+double benchExec(benchProgram& p, long long& ops) {
+  benchSoup b(cfg.memSize);
+  Soup& soup = b.soup;
+  int i;
+  for (i=0; i < BENCHPROGRAM; i++)
+    soup.memWrite(i, p.code[i]);
+  b.add(0, BENCHPROGRAM);
+
+  long long cycles = 200000;
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  long long c;
+  for (c=0; c < cycles; c++)
+    (soup.*soup.runReal)(soup.CPUs->first(), NULL);
+  double t = since(start);
+  ops = cycles * cfg.stepsPerCycle;
+  return t;
+}
+
+// **************************************************************** //
+// MAL: memFree of a random place and size with memory filled to fill,
+// taking and giving back the memory when it is free, with fit the
+// nearest free place when it isn't (MALFIT=1)
+// ns per try
+
+double benchMal(double fill, bool fit, long long& ops) {
+  Config c = cfg;
+  c.malFit = fit;
+  benchSoup b(c.memSize, c);
+  Soup& soup = b.soup;
+  Rng rng;
+  rng.seed(1);
+  // owner of the memory taken, then Machines filling memory
+  Machine* m = soup.machines->alloc(0, cfg.minSize);
+  int tries = 0;
+  while (soup.memAvailable() > soup.memSize * (1 - fill) &&
+         tries < 1000000) {
+    tries++;
+    int loc = rng.below(soup.memSize);
+    int len = cfg.minSize + rng.below(cfg.maxSize - cfg.minSize + 1);
+    if (soup.memFree(loc, len) && b.add(loc, len) == NULL) break;
+  }
+
+  ops = 1000000;
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  long long k;
+  for (k=0; k < ops; k++) {
+    int loc = rng.below(soup.memSize);
+    int len = cfg.minSize + rng.below(cfg.maxSize - cfg.minSize + 1);
+    bool found = soup.memFree(loc, len);
+    if (!found && fit) {
+      loc = soup.memProtect->nearestFree(loc, len);
+      found = loc >= 0;
+    }
+    if (found) {
+      soup.memAlloc(loc, len, m);
+      soup.memDealloc(loc, len);
+    }
+  }
+  return since(start);
+}
+
+// **************************************************************** //
+// Reaper: memory full of Machines, killCPU() until the loop in run()
+// would stop
+// ns per Machine killed
+
+double benchReaper(long long& ops) {
+  double t = 0;
+  ops = 0;
+  int round;
+  for (round=0; round < 50; round++) {
+    benchSoup b(cfg.memSize);
+    Soup& soup = b.soup;
+    Rng rng;
+    rng.seed(round);
+    int loc = 0;
+    for (;;) {
+      int len = cfg.minSize + rng.below(32);
+      if (loc + len > soup.memSize || b.add(loc, len) == NULL) break;
+      loc += len;
+    }
+    int numAlive = soup.CPUs->size();
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    while (soup.memAvailable() < (soup.memSize*cfg.minFreeMem) ||
+           numAlive >= cfg.maxAlive) {
+      soup.killCPU();
+      numAlive--;
+      ops++;
+    }
+    t += since(start);
+  }
+  return t;
+}
+
+// **************************************************************** //
+// Statistics of memory: printStats() of a million cells, a third of
+// them runs of free memory, the rest instructions with one cell in a
+// hundred some other value
+// ns per cell
+
+double benchStats(long long& ops) {
+  benchSoup b(1000000);
+  Soup& soup = b.soup;
+  Rng rng;
+  rng.seed(3);
+  int i;
+  for (i=0; i < soup.memSize; i++) {
+    if ((i >> 12) % 3 == 0) soup.memory[i] = NOP;
+    else if (rng.below(100) == 0) soup.memory[i] = rng.next();
+    else soup.memory[i] = rng.below(NINSTR);
+  }
+  soup.printStats();
+  
+  int reports = 20;
+  ops = (long long)reports * soup.memSize;
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (i=0; i < reports; i++)
+    soup.printStats();
+  return since(start);
+}
+
+// **************************************************************** //
+// Queue: promote of random places, then dequeue and enqueue round it
+// ns per operation
+
+double benchPromote(long long& ops) {
+  Queue<Machine*> q;
+  int i;
+  for (i=0; i < 1000; i++)
+    q.enqueue(NULL);
+  Rng rng;
+  rng.seed(2);
+
+  ops = 10000000;
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  long long k;
+  for (k=0; k < ops; k++)
+    q.promote(q.first() + rng.below(q.size()));
+  return since(start);
+}
+double benchCycle(long long& ops) {
+  Queue<Machine*> q;
+  int i;
+  for (i=0; i < 1000; i++)
+    q.enqueue(NULL);
+
+  ops = 10000000;
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  long long k;
+  for (k=0; k < ops; k++)
+    q.enqueue(q.dequeue());
+  return since(start);
+}
+
+// **************************************************************** //
+// Run benchmark number i (false past the last), best of BENCHREPEATS
+
+bool runBench(int i, benchResult& r) {
+  int numPrograms = sizeof(programs) / sizeof(programs[0]);
+  double fills[] = { 0.25, 0.5, 0.75, 0.9 };
+  int numFills = sizeof(fills) / sizeof(fills[0]);
+  double best = -1;
+  int rep;
+  for (rep=0; rep < BENCHREPEATS; rep++) {
+    long long ops;
+    double t;
+    std::ostringstream name;
+    if (i < numPrograms) {
+      name << programs[i].name;
+      t = benchExec(programs[i], ops);
+    } else if (i < numPrograms + 2*numFills) {
+      int k = i - numPrograms;
+      double fill = fills[k % numFills];
+      bool fit = k >= numFills;
+      name << (fit ? "malfit_fill" : "mal_fill") << (int)(fill*100);
+      t = benchMal(fill, fit, ops);
+    } else if (i == numPrograms + 2*numFills) {
+      name << "reaper";
+      t = benchReaper(ops);
+    } else if (i == numPrograms + 2*numFills + 1) {
+      name << "queue_promote";
+      t = benchPromote(ops);
+    } else if (i == numPrograms + 2*numFills + 2) {
+      name << "queue_cycle";
+      t = benchCycle(ops);
+    } else if (i == numPrograms + 2*numFills + 3) {
+      name << "stats";
+      t = benchStats(ops);
+    } else {
+      return false;
+    }
+    double ns = ops > 0 ? t * 1e9 / ops : 0;
+    if (best < 0 || ns < best) best = ns;
+    r.name = name.str();
+    r.ops = ops;
+  }
+  r.ns = best;
+  return true;
+}
+
+// **************************************************************** //
+// Results from a file written by Bench.o
+
+bool readResults(const char* file, std::vector<benchResult>& results) {
+  std::ifstream f(file);
+  if (!f) {
+    std::cerr << "Can't read " << file << "\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(f, line)) {
+    size_t i;
+    for (i=0; i < line.size(); i++)
+      if (line[i] == ',') line[i] = ' ';
+    std::istringstream words(line);
+    benchResult r;
+    if (words >> r.name >> r.ops >> r.ns) results.push_back(r);
+  }
+  return true;
+}
+
+// Each benchmark of old and new, and how much slower (+) or faster (-)
+int compare(const char* oldFile, const char* newFile) {
+  std::vector<benchResult> before, after;
+  if (!readResults(oldFile, before) || !readResults(newFile, after))
+    return 1;
+  std::cout << std::left << std::setw(16) << "benchmark";
+  std::cout << std::right << std::setw(12) << "old ns/op";
+  std::cout << std::setw(12) << "new ns/op" << std::setw(10) << "change\n";
+  int i, j;
+  for (i=0; i < (int)after.size(); i++)
+    for (j=0; j < (int)before.size(); j++) {
+      if (before[j].name != after[i].name) continue;
+      std::cout << std::left << std::setw(16) << after[i].name;
+      std::cout << std::right << std::fixed << std::setprecision(2);
+      std::cout << std::setw(12) << before[j].ns;
+      std::cout << std::setw(12) << after[i].ns;
+      std::cout << std::setw(8) << std::showpos;
+      std::cout << (after[i].ns / before[j].ns - 1) * 100;
+      std::cout << std::noshowpos << "%\n";
+    }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc == 4 && strcmp(argv[1], "compare") == 0)
+    return compare(argv[2], argv[3]);
+
+  std::ofstream file;
+  if (argc == 3 && strcmp(argv[1], "-o") == 0) {
+    file.open(argv[2]);
+  } else if (argc != 1) {
+    std::cerr << "usage: Bench.o [-o file] | compare old new\n";
+    return 1;
+  }
+  std::ostream& out = file.is_open() ? file : std::cout;
+
+  // no faults, no writer thread, nothing on disk
+  cfg.errorChance = 1 << 30;
+  cfg.mutChance = 1 << 30;
+  cfg.writePolicy = 0;
+  cfg.phylogeny = 0;
+  cfg.output = 0;
+
+  benchResult r;
+  int i;
+  for (i=0; runBench(i, r); i++) {
+    out << r.name << "," << r.ops << "," << std::fixed
+        << std::setprecision(3) << r.ns << "\n";
+    out.flush();
+  }
+  return 0;
+}
@@ -0,0 +1,50 @@
+// Decoder for the binary output of Simulation (OUTPUT=1)
+// Prints the text Simulation would have printed with OUTPUT=0,
+// with -e births and deaths as well
+//
+// usage: Decode.o [-e] [file (default out.bin)]
+
+// Record layout and formatting are Simulation.cpp's (see formatRecord)
+#define NOMAIN
+#include "Simulation.cpp"
+
+// **************************************************************** //
+//                           Functions
+// **************************************************************** //
+
+// Decode records from in to out until the end of the stream
+
+bool decodeRecords(std::istream& in, std::ostream& out, bool events) {
+  std::vector<char> payload;
+  int type;
+  while ((type = in.get()) != EOF) {
+    int32_t len;
+    if (!in.read((char*)&len, 4) || len < 0) return false;
+    payload.resize(len + 1);
+    if (!in.read(&payload[0], len)) return false;
+    snapReader r = { &payload[0], &payload[0] + len, true };
+    if (!formatRecord(type, r, out, events)) return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool events = false;
+  const char* file = "out.bin";
+  int i;
+  for (i=1; i < argc; i++) {
+    if (strcmp(argv[i], "-e") == 0) events = true;
+    else file = argv[i];
+  }
+
+  std::ifstream in(file, std::ios::binary);
+  if (!in) {
+    std::cerr << "Can't read " << file << "\n";
+    return 1;
+  }
+  if (!decodeRecords(in, std::cout, events)) {
+    std::cerr << "Bad record in " << file << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,264 @@
+// Reader for the phylogeny log of Simulation (phylo.bin, PHYLOGENY=1)
+// Machines are known by birth number (1 for the first born)
+//
+// usage: Phylo.o [-f file (default phylo.bin)] [ancestors ID | subtree ID]
+//   ancestors ID  the birth of ID, its parent's, and so on back
+//   subtree ID    the births and deaths of ID and all its descendants
+//   otherwise     number of blocks, births, deaths and steps
+//
+// Only the block headers are held in memory (and the birth numbers of
+// the living members of a subtree), blocks are read one at a time as
+// they are needed
+
+// File layout is PhyloLog's in Simulation.cpp
+#define NOMAIN
+#include "Simulation.cpp"
+#include<set>
+
+// **************************************************************** //
+//                    Classes and structures
+// **************************************************************** //
+
+struct blockInfo {
+  long long offset;  // of the events
+  int bytes;
+  int events;
+  int step;
+  uint64_t birth;
+};
+
+struct event {
+  bool death;
+  int step;
+  uint64_t num;
+  uint64_t parent;   // births only, 0 if none
+  int location;
+  int size;
+  int label;
+};
+
+// events of one block, ok goes false on a bad block
+class blockReader {
+  private:
+    std::vector<unsigned char> data;
+    size_t pos;
+    int left;
+    int step;
+    uint64_t birth;
+
+    uint64_t get() {
+      uint64_t v = 0;
+      int shift = 0;
+      while (pos < data.size() && shift < 64) {
+        unsigned char c = data[pos++];
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (c < 0x80) return v;
+        shift += 7;
+      }
+      ok = false;
+      return 0;
+    }
+  public:
+    bool ok;
+
+    blockReader(std::ifstream& in, const blockInfo& b) : data(b.bytes) {
+      pos = 0;
+      left = b.events;
+      step = b.step;
+      birth = b.birth;
+      in.clear();
+      in.seekg(b.offset);
+      ok = b.bytes == 0 || in.read((char*)&data[0], b.bytes);
+    }
+    // false at the end of the block
+    bool next(event& e) {
+      if (left == 0 || !ok) return false;
+      left--;
+      uint64_t head = get();
+      step += head / 2;
+      e.step = step;
+      e.death = head & 1;
+      if (e.death) {
+        e.num = birth - get();
+      } else {
+        e.num = ++birth;
+        uint64_t back = get();
+        e.parent = back == 0 ? 0 : e.num - back;
+        e.location = get();
+        e.size = get();
+        e.label = get();
+      }
+      return ok;
+    }
+};
+
+// **************************************************************** //
+//                           Functions
+// **************************************************************** //
+
+// Read every block header, false if in isn't a phylogeny log
+bool readIndex(std::ifstream& in, std::vector<blockInfo>& blocks) {
+  char magic[4];
+  int32_t version;
+  if (!in.read(magic, 4) || !in.read((char*)&version, 4) ||
+      memcmp(magic, PHYLOMAGIC, 4) != 0 || version != PHYLOVERSION)
+    return false;
+  char head[PHYLOHEADER];
+  while (in.read(head, PHYLOHEADER)) {
+    blockInfo b;
+    memcpy(&b.bytes, head, 4);
+    memcpy(&b.events, head + 4, 4);
+    memcpy(&b.step, head + 8, 4);
+    memcpy(&b.birth, head + 16, 8);
+    b.offset = in.tellg();
+    if (b.bytes < 0 || b.events < 0) return false;
+    blocks.push_back(b);
+    in.seekg(b.bytes, std::ios::cur);
+  }
+  return true;
+}
+
+// Block holding the birth of num (the last starting before it)
+int findBlock(std::vector<blockInfo>& blocks, uint64_t num) {
+  int lo = 0, hi = blocks.size();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (blocks[mid].birth < num) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+void printEvent(const event& e, std::ostream& out) {
+  out << e.num << ": ";
+  if (e.death) {
+    out << "died step " << e.step << "\n";
+    return;
+  }
+  out << "born step " << e.step << ", parent " << e.parent;
+  out << ", at " << e.location << ", size " << e.size << ", genotype ";
+  formatGenotype(e.size, e.label, out);
+  out << "\n";
+}
+
+// **************************************************************** //
+// Birth of num, then of its parent, and so on back
+
+bool ancestors(std::ifstream& in, std::vector<blockInfo>& blocks,
+               uint64_t num) {
+  while (num != 0) {
+    int b = findBlock(blocks, num);
+    if (b < 0) return false;
+    blockReader r(in, blocks[b]);
+    event e;
+    bool found = false;
+    while (r.next(e)) {
+      if (e.death || e.num != num) continue;
+      printEvent(e, std::cout);
+      num = e.parent;
+      found = true;
+      break;
+    }
+    if (!found) return false;
+  }
+  return true;
+}
+
+// **************************************************************** //
+// Births and deaths of num and its descendants
+
+bool subtree(std::ifstream& in, std::vector<blockInfo>& blocks,
+             uint64_t num) {
+  std::set<uint64_t> members;
+  members.insert(num);
+  int b = findBlock(blocks, num);
+  if (b < 0) return false;
+  for (; b < (int)blocks.size(); b++) {
+    blockReader r(in, blocks[b]);
+    event e;
+    while (r.next(e)) {
+      if (e.death) {
+        // a dead Machine has no later children, so only the living
+        // members are kept
+        if (members.erase(e.num) == 0) continue;
+      } else if (e.num != num) {
+        if (e.num < num || members.count(e.parent) == 0) continue;
+        members.insert(e.num);
+      }
+      printEvent(e, std::cout);
+    }
+    if (!r.ok) return false;
+  }
+  return true;
+}
+
+// **************************************************************** //
+// Totals over the whole log
+
+bool summary(std::ifstream& in, std::vector<blockInfo>& blocks) {
+  long long births = 0, deaths = 0;
+  int first = -1, last = -1;
+  int b;
+  for (b=0; b < (int)blocks.size(); b++) {
+    blockReader r(in, blocks[b]);
+    event e;
+    while (r.next(e)) {
+      if (e.death) deaths++;
+      else births++;
+      if (first < 0) first = e.step;
+      last = e.step;
+    }
+    if (!r.ok) return false;
+  }
+  std::cout << "Blocks: " << blocks.size() << "\n";
+  std::cout << "Births: " << births << "\n";
+  std::cout << "Deaths: " << deaths << "\n";
+  std::cout << "Steps : " << first << "-" << last << "\n";
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const char* file = "phylo.bin";
+  std::string command;
+  uint64_t num = 0;
+  int i;
+  for (i=1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+      file = argv[++i];
+    } else if (command.empty() && i+1 < argc) {
+      command = argv[i];
+      num = strtoull(argv[++i], NULL, 10);
+    } else {
+      std::cerr << "usage: Phylo.o [-f file] [ancestors ID | subtree ID]\n";
+      return 1;
+    }
+  }
+
+  std::ifstream in(file, std::ios::binary);
+  std::vector<blockInfo> blocks;
+  if (!in) {
+    std::cerr << "Can't read " << file << "\n";
+    return 1;
+  }
+  if (!readIndex(in, blocks)) {
+    std::cerr << file << " isn't a phylogeny log\n";
+    return 1;
+  }
+
+  bool ok;
+  if (command == "ancestors") {
+    ok = ancestors(in, blocks, num);
+  } else if (command == "subtree") {
+    ok = subtree(in, blocks, num);
+  } else if (command.empty()) {
+    ok = summary(in, blocks);
+  } else {
+    std::cerr << "Unknown command " << command << "\n";
+    return 1;
+  }
+  if (!ok) {
+    std::cerr << "Bad or missing entry in " << file << "\n";
+    return 1;
+  }
+  return 0;
+}
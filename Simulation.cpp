@@ -4,6 +4,33 @@
 #include<time.h>
 #include<iomanip>
 #include<assert.h>
+#include<math.h>
+#include<stdint.h>
+#include<map>
+#include<set>
+#include<vector>
+#include<atomic>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<string>
+#include<stdio.h>
+#include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sstream>
+#include<chrono>
+#include<algorithm>
+#include<functional>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
+
+// Run parameters
+// These are the defaults, each can be changed at run time by name,
+// on the command line or in a config file (see Config)
 
 // Memory size
 #define MEMSIZE 30000
@@ -11,12 +38,21 @@
 // Machine population limits
 #define MAXALIVE 100
 #define MINFREEMEM 0.35
+// Most Machines that can exist at once, the largest MAXALIVE allowed
+// (every Machine owns at least MINSIZE cells, so this is never reached
+//  for memory sizes up to MAXMACHINES*MINSIZE)
+#define MAXMACHINES (1 << 20)
 
 // Machine size limits
 #define MINSIZE 12
 #define MAXSIZE 300
 
+// MAL of memory that isn't free fails (0), or takes the free place
+// nearest the one asked for (1)
+#define MALFIT 0
+
 // Machine data structure size
+// (the interpreter is compiled specially for these sizes, see runCPU)
 #define LOOPSTACKSIZE 4
 #define DATASTACKSIZE 8
 #define NREGS 4
@@ -25,11 +61,81 @@
 #define SIMSTEPS 200000
 // Information output regularity
 #define PRINTINFOTIME 50000
+// Output format, 0 for text (out.txt), 1 for a compact binary stream
+// (out.bin, Decode.o turns it back into the text)
+#define OUTPUT 0
+// How reports reach the output file: 0 written by the simulation itself,
+// otherwise formatted and written by a writer thread, and when that falls
+// behind the simulation 1 waits, 2 drops the report, 3 coalesces reports
+// until there is room (see Reporter)
+#define WRITEPOLICY 1
 // Machine steps per simulation step
 #define STEPSPERCYCLE 50
 // Machine error penalty
 #define ERRORSTEPS 10
 
+// Island mode
+// number of islands, each island is a separate soup on its own thread,
+// every MIGRATETIME steps MIGRANTS genomes are copied from each island
+// to the next
+#define ISLANDS 1
+#define MIGRATETIME 1000
+#define MIGRANTS 2
+// places tried for an arriving genome before it is dropped
+#define MIGRATETRIES 10
+
+// Threads running the Machines of each soup,
+// the result is the same for any number
+#define THREADS 1
+// Speculative runs of the Machines in lockstep, LANES at a time (1), or
+// one by one (0), on any number of THREADS, see runLockstep()
+#define LOCKSTEP 0
+
+// Log every birth and death to phylo.bin (1) or not (0),
+// Phylo.o reads it back
+#define PHYLOGENY 0
+
+// Record a trace of the state every TRACETIME steps to trace.bin (1),
+// or check the run against one (2) and stop where it first differs,
+// 0 for neither
+#define TRACE 0
+#define TRACETIME 1000
+
+// Report statistics of memory every STATSTIME steps (0 for never):
+// instruction counts, occupied cells, cells changed since the last
+// report, and entropy, of the whole soup and of each STATSREGION cells
+#define STATSTIME 0
+#define STATSREGION 1024
+
+// Steps between snapshots of each soup (0 for none), a run can be resumed
+// from the last one with RESUME=1
+#define CHECKPOINTTIME 50000
+
+// Ending a run early: when no Machines are left (1) or not (0), and when
+// no Machine has been born for STALLSTEPS steps (0 for never)
+#define STOPEXTINCT 0
+#define STALLSTEPS 0
+
+// Threads running the runs of a sweep (see -s), 0 for one per core
+#define SWEEPTHREADS 0
+// Step a sweep branches at (0 for none): the sweep's base settings run
+// to step FORKSTEP once, then every run carries on from that state
+#define FORKSTEP 0
+
+// Computed goto dispatch in the interpreter (GCC and Clang only),
+// comment out for a plain switch
+#define THREADED
+// Run common instruction sequences as one superinstruction
+#define FUSION
+// Run stack and register instructions in bursts, up to the next one that
+// touches memory or the loop stack, checking for the end of the slice,
+// errors and execution faults once per burst instead of every step
+// (see runCPU), comment out to check every instruction
+#define BURST
+// Count instructions, faults and other events and time the phases of
+// each step, printed with the info (see counters), uncomment to enable
+//#define COUNTERS
+
 // enable assertions
 #define NDEBUG
  
@@ -40,6 +146,13 @@
 // 1/ERRORCHANCE =
 //  chance a random instruction is executed instead of intended one
 
+// Largest values allowed at run time for sizes that are stored inline
+#define MAXSTACK 32
+#define MAXREGS 16
+#define MAXGENOME 1000
+// length of the seed Machine (see generatePrimeval())
+#define PRIMEVALSIZE 136
+
 /* TODO
  * 
  */
@@ -48,38 +161,41 @@
 //                    Classes and structures
 // **************************************************************** //
 
-// stack using array
-struct StackUnderflow {};
-struct StackOverflow {};
-template<class T> class Stack {
+// stack using fixed size array, stored inline
+// push/pop return false on overflow/underflow rather than throwing
+template<class T, int N> class Stack {
   private:
     int top;
-    int capacity;
-    T* storage;
+    T storage[N];
   public:
-    Stack(int cap) {
-      if (cap <= 0)
-        cap = 1;
+    Stack() {
       top = 0;
-      capacity = cap;
-      storage = new T[capacity];
     }
-    void push(T value) {
-      if (top == capacity)
-        throw StackOverflow();
+    // return false on overflow (stack unchanged),
+    // the stack holds at most limit (<= N) values
+    bool push(T value, int limit = N) {
+      if (top == limit)
+        return false;
       storage[top++] = value;
+      return true;
     }
-    T pop() {
+    // return false on underflow (value unchanged)
+    bool pop(T& value) {
       if (top == 0)
-        throw StackUnderflow();
-      return storage[--top];
+        return false;
+      value = storage[--top];
+      return true;
     }
     bool isEmpty() {
       if (top == 0) return true;
       else return false;
     }
-    ~Stack() {
-      delete[] storage;
+    int size() {
+      return top;
+    }
+    // i-th value from the top (0 is the top), stack must be deep enough
+    T peek(int i) {
+      return storage[top-1-i];
     }
     void resetStack() {
       top = 0;
@@ -93,102 +209,850 @@ template<class T> class Stack {
     }
 };
 
-// queue using linked list
+// queue as a ring of slots in one array, doubled when full
+// every place in the queue has a position, counting up from the first
+// value ever enqueued, which stays the same while values before it are
+// dequeued and after it enqueued, so positions serve as handles
+// (promote/demote move a value by swapping it with its neighbour, the
+// position then holds the neighbour)
 struct QueueEmpty {};
-template<class T> struct node {
-  T val;
-  node* next; // closer to rear
-  node* prev; // closer to front
-};
 template<class T> class Queue {
   private:
-    node<T>* front;
-    node<T>* rear;
+    T* storage;
+    unsigned mask;  // capacity - 1, capacity a power of 2
+    unsigned head;  // position of the front
+    unsigned tail;  // position after the rear
+    
+    void grow() {
+      unsigned newMask = 2*mask + 1;
+      T* temp = new T[newMask + 1];
+      unsigned p;
+      for (p=head; p != tail; p++)
+        temp[p & newMask] = storage[p & mask];
+      delete[] storage;
+      storage = temp;
+      mask = newMask;
+    }
   public:
     Queue() {
-      front = NULL;
-      rear = NULL;
+      mask = 255;
+      storage = new T[mask + 1];
+      head = 0;
+      tail = 0;
+    }
+    ~Queue() {
+      delete[] storage;
     }
     void enqueue(T value) {
       // add to rear of queue
-      node<T>* temp = new node<T>;
-      temp->val = value;
-      temp->next = NULL; 
-      temp->prev = rear;
-      
-      if (front == NULL) front = temp;
-      else rear->next = temp;
-      rear = temp;
+      if (tail - head > mask) grow();
+      storage[tail++ & mask] = value;
     }
     T dequeue() {
       // remove from front of queue
-      if (front == NULL) throw QueueEmpty();
-      
-      node<T>* temp = new node<T>;
-      temp = front;
-      front = front->next;
-      
-      T value = temp->val;
-      delete temp;
-      return value;
+      if (head == tail) throw QueueEmpty();
+      return storage[head++ & mask];
+    }
+    // positions of the front and after the rear, in order from front
+    // to rear: for (p = q.first(); p != q.end(); p++) q[p]
+    unsigned first() {
+      return head;
     }
-    node<T>* getHead() {
-      return front;
+    unsigned end() {
+      return tail;
     }
-    void promote(node<T>* n) {
+    T& operator[](unsigned p) {
+      return storage[p & mask];
+    }
+    void promote(unsigned p) {
       // if front, can't promote
-      if (n == front) return;
+      if (p == head) return;
       // swap values with prev
-      T temp = n->val;
-      n->val = n->prev->val;
-      n->prev->val = temp;
+      T temp = storage[p & mask];
+      storage[p & mask] = storage[(p-1) & mask];
+      storage[(p-1) & mask] = temp;
     }
-    void demote(node<T>* n) {
+    void demote(unsigned p) {
       // if rear, can't demote
-      if (n == rear) return;
+      if (p+1 == tail) return;
       // swap values with next
-      T temp = n->val;
-      n->val = n->next->val;
-      n->next->val = temp;
+      T temp = storage[p & mask];
+      storage[p & mask] = storage[(p+1) & mask];
+      storage[(p+1) & mask] = temp;
     }
     bool isEmpty() {
-      if (front == NULL) return true;
-      else return false;
+      return head == tail;
+    }
+    int size() {
+      return tail - head;
+    }
+};
+
+// lock-free queue between exactly one producer and one consumer thread
+// ring of N slots (N a power of 2), each index is only written by one side
+template<class T, int N> class HandoffQueue {
+  private:
+    T storage[N];
+    // separate cache lines so the two sides don't contend
+    alignas(64) std::atomic<unsigned> head; // next to pop, consumer's
+    alignas(64) std::atomic<unsigned> tail; // next to push, producer's
+  public:
+    HandoffQueue() {
+      head = 0;
+      tail = 0;
+    }
+    // return false if full (producer only)
+    bool push(const T& value) {
+      unsigned t = tail.load(std::memory_order_relaxed);
+      if (t - head.load(std::memory_order_acquire) == N)
+        return false;
+      storage[t % N] = value;
+      tail.store(t+1, std::memory_order_release);
+      return true;
+    }
+    // return false if empty (consumer only)
+    bool pop(T& value) {
+      unsigned h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire))
+        return false;
+      value = storage[h % N];
+      head.store(h+1, std::memory_order_release);
+      return true;
+    }
+};
+
+// bytes being built (snapshots and binary output)
+struct snapBuffer {
+  std::vector<char> data;
+  
+  void put(const void* p, size_t n) {
+    data.insert(data.end(), (const char*)p, (const char*)p + n);
+  }
+  void put32(int32_t v) {
+    put(&v, 4);
+  }
+  void put64(uint64_t v) {
+    put(&v, 8);
+  }
+  void put(const std::vector<int>& v) {
+    if (!v.empty()) put(&v[0], 4*v.size());
+  }
+};
+// bytes being read, ok goes false on reading past the end
+struct snapReader {
+  const char* p;
+  const char* end;
+  bool ok;
+  
+  void get(void* v, size_t n) {
+    if (end - p < (long)n) {
+      ok = false;
+      memset(v, 0, n);
+      return;
     }
+    memcpy(v, p, n);
+    p += n;
+  }
+  int32_t get32() {
+    int32_t v;
+    get(&v, 4);
+    return v;
+  }
+  uint64_t get64() {
+    uint64_t v;
+    get(&v, 8);
+    return v;
+  }
+};
+
+
+// random number generator (PCG32)
+// small explicit state, so every Machine can carry its own stream
+class Rng {
+  private:
+    uint64_t state;
+  public:
+    void seed(uint64_t s) {
+      state = 0;
+      next();
+      state += s;
+      next();
+    }
+    uint32_t next() {
+      uint64_t old = state;
+      state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+      uint32_t shifted = ((old >> 18) ^ old) >> 27;
+      uint32_t rot = old >> 59;
+      return (shifted >> rot) | (shifted << ((32 - rot) & 31));
+    }
+    // raw state, for snapshots
+    uint64_t getState() {
+      return state;
+    }
+    void setState(uint64_t s) {
+      state = s;
+    }
+    uint64_t next64() {
+      uint64_t hi = next();
+      return (hi << 32) | next();
+    }
+    // uniform in [0, n)
+    uint32_t below(uint32_t n) {
+      return ((uint64_t)next() * n) >> 32;
+    }
+    // number of trials up to and including the first success,
+    // for events with probability 1/chance per trial
+    int geometric(int chance) {
+      if (chance <= 1) return 1;
+      double u = (next() + 1.0) / 4294967296.0;
+      double gap = floor(log(u) / log1p(-1.0 / chance)) + 1;
+      if (gap > 2147483647.0) return 2147483647;
+      return gap;
+    }
+};
+
+// Owner IDs
+// pool slot + 1 in the low SLOTBITS bits (0 means no owner),
+// generation of the slot in the other 32-SLOTBITS so IDs of dead
+// Machines go stale (an ID is only mistaken for a live one after
+// 2^(32-SLOTBITS) reuses of its slot)
+typedef unsigned int ownerId;
+#define SLOTBITS 21
+#if MAXMACHINES >= (1 << SLOTBITS)
+#error "MAXMACHINES too large for the slot bits of owner IDs"
+#endif
+#define SLOTMASK ((1u << SLOTBITS) - 1)
+#define NOOWNER 0
+
+// run parameters, the #defines at the top are the defaults
+// set once at startup (see setOption()) and only read after,
+// so islands can share it
+struct Config {
+  int memSize;
+  int maxAlive;
+  double minFreeMem;
+  int minSize;
+  int maxSize;
+  int malFit;
+  int loopStackSize;
+  int dataStackSize;
+  int nRegs;
+  int simSteps;
+  int printInfoTime;
+  int stepsPerCycle;
+  int errorSteps;
+  int mutChance;
+  int errorChance;
+  int islands;
+  int migrateTime;
+  int migrants;
+  int migrateTries;
+  int threads;
+  int lockstep;
+  int checkpointTime;
+  int stopExtinct;
+  int stallSteps;
+  int sweepThreads;
+  int forkStep;
+  int output;
+  int writePolicy;
+  int phylogeny;
+  int trace;
+  int traceTime;
+  int statsTime;
+  int seed;
+  int resume;
 };
+Config cfg = {
+  MEMSIZE, MAXALIVE, MINFREEMEM, MINSIZE, MAXSIZE, MALFIT,
+  LOOPSTACKSIZE, DATASTACKSIZE, NREGS,
+  SIMSTEPS, PRINTINFOTIME, STEPSPERCYCLE, ERRORSTEPS,
+  MUTCHANCE, ERRORCHANCE,
+  ISLANDS, MIGRATETIME, MIGRANTS, MIGRATETRIES,
+  THREADS, LOCKSTEP, CHECKPOINTTIME, STOPEXTINCT, STALLSTEPS, SWEEPTHREADS,
+  FORKSTEP, OUTPUT, WRITEPOLICY,
+  PHYLOGENY, TRACE, TRACETIME, STATSTIME, 0, 0
+};
+// names of the settings given at startup rather than left at their
+// defaults, by argument, config file or sweep file
+std::set<std::string> cfgGiven;
 
 // basic machine structure
+// registers and stacks are stored inline so a Machine is one flat block
 class Machine {
   public:
+    ownerId id;
     int location;
     int IP;
-    short* reg;
-    Stack<short>* dataStack;
-    Stack<short>* loopStack;
+    short reg[MAXREGS];
+    Stack<short, MAXSTACK> dataStack;
+    Stack<int, MAXSTACK> loopStack;
     
     int mySize;
     int childLoc;
     int childSize;
     
-    Machine(int loc, int size) {
+    // faults are scheduled rather than rolled for every instruction,
+    // errorIn instructions until the next execution fault
+    // mutateIn COPY/WRITEs until the next copy fault
+    Rng rng;
+    int errorIn;
+    int mutateIn;
+    
+    // genotype, index in the Soup's Genebank
+    int genotypeNum;
+    // birth number in the phylogeny log (0 when there's no log)
+    uint64_t birthNum;
+    
+    void init(int loc, int size, int nRegs) {
       location = loc;
       IP = loc;
       
-      reg = new short[ NREGS ];
       int i;
-      for (i=0; i<NREGS; i++)
+      for (i=0; i<nRegs; i++)
         reg[i]=0;
-      dataStack = new Stack<short>( DATASTACKSIZE );
-      loopStack = new Stack<short>( LOOPSTACKSIZE );
+      dataStack.resetStack();
+      loopStack.resetStack();
       
       mySize = size;
       childLoc = -1;
       childSize = -1;
     }
-    ~Machine() {
-      delete[] reg;
-      delete dataStack;
-      delete loopStack;
+    void seed(uint64_t s, const Config& c) {
+      rng.seed(s);
+      errorIn = rng.geometric(c.errorChance);
+      mutateIn = rng.geometric(c.mutChance);
+    }
+    // random instruction for execution/copy faults
+    signed char randomInstr() {
+      return rng.below(20);
+    }
+};
+
+// pool of Machines, addressed by index
+// slots come in chunks that are never moved or freed, free slots are kept
+// on a stack, so births and deaths don't touch the heap once warmed up
+// and recently freed (still cached) slots are reused first
+#define POOLCHUNK 4096
+class MachinePool {
+  private:
+    Machine** chunks;
+    int numSlots;
+    int* freeSlots;
+    int numFree;
+    int capacity;
+    int nRegs;  // registers of each Machine
+    
+    void addChunk() {
+      int n = capacity - numSlots;
+      if (n > POOLCHUNK) n = POOLCHUNK;
+      chunks[numSlots / POOLCHUNK] = new Machine[POOLCHUNK];
+      
+      int* temp = new int[numSlots + n];
+      int i;
+      for (i=0; i < numFree; i++)
+        temp[i] = freeSlots[i];
+      delete[] freeSlots;
+      freeSlots = temp;
+      // lowest slots handed out first
+      for (i=numSlots+n-1; i >= numSlots; i--) {
+        (*this)[i]->id = i+1;
+        freeSlots[numFree++] = i;
+      }
+      numSlots += n;
+    }
+  public:
+    MachinePool(int cap, int regs) {
+      capacity = cap;
+      nRegs = regs;
+      assert(capacity > 0 && capacity <= MAXMACHINES);
+      chunks = new Machine*[(capacity + POOLCHUNK-1) / POOLCHUNK];
+      numSlots = 0;
+      freeSlots = NULL;
+      numFree = 0;
+      addChunk();
+    }
+    ~MachinePool() {
+      int i;
+      for (i=0; i < numSlots; i += POOLCHUNK)
+        delete[] chunks[i / POOLCHUNK];
+      delete[] chunks;
+      delete[] freeSlots;
+    }
+    // return NULL if all capacity slots are in use
+    Machine* alloc(int loc, int size) {
+      if (numFree == 0) {
+        if (numSlots == capacity) return NULL;
+        addChunk();
+      }
+      Machine* m = (*this)[freeSlots[--numFree]];
+      m->init(loc, size, nRegs);
+      return m;
+    }
+    void release(Machine* m) {
+      assert(numFree < numSlots);
+      int slot = (m->id & SLOTMASK) - 1;
+      // next generation, so the old ID no longer finds this slot
+      m->id = ((m->id >> SLOTBITS) + 1) << SLOTBITS | (slot+1);
+      freeSlots[numFree++] = slot;
+    }
+    // Machine with this ID, NULL if it has died since
+    Machine* get(ownerId id) {
+      int slot = (id & SLOTMASK) - 1;
+      if (slot < 0 || slot >= numSlots) return NULL;
+      Machine* m = (*this)[slot];
+      if (m->id != id) return NULL;
+      return m;
+    }
+    Machine* operator[](int i) {
+      return &chunks[i / POOLCHUNK][i % POOLCHUNK];
+    }
+    // slots made so far and the free slot stack (bottom first),
+    // for snapshots
+    int slots() {
+      return numSlots;
+    }
+    int numFreeSlots() {
+      return numFree;
+    }
+    int freeSlot(int i) {
+      return freeSlots[i];
+    }
+    // bring a new pool to a saved shape, the Machines in every slot are
+    // then filled in through operator[]
+    // return false if the shape doesn't fit this pool
+    bool restore(int slots, const std::vector<int>& freeList) {
+      if (slots > capacity || (int)freeList.size() > slots) return false;
+      while (numSlots < slots) addChunk();
+      if (numSlots != slots) return false;
+      numFree = 0;
+      int i;
+      for (i=0; i < (int)freeList.size(); i++) {
+        if (freeList[i] < 0 || freeList[i] >= numSlots) return false;
+        freeSlots[numFree++] = freeList[i];
+      }
+      return true;
+    }
+};
+
+// free runs of memory, for finding the free place nearest a given one
+// a bitmap of the cells (1 for free) in blocks of 64, under a segment
+// tree over the blocks, each node holding the length of the free run
+// at the start of its cells, at the end, and the longest anywhere in
+// them; marking cells is O(len/64 + log size), a search is O(log size)
+// plus a scan of the blocks at its ends. Under a byte a cell. Cells
+// past the end count as taken, so no run found wraps
+#define FREEBLOCK 64
+class FreeIndex {
+  private:
+    struct run {
+      int pre, suf, best;
+    };
+    std::vector<uint64_t> bits;  // cell i is bit i%64 of bits[i/64]
+    std::vector<run> tree;       // node k has children 2k and 2k+1
+    int leaves;                  // block i is node leaves+i, a power of 2
+    
+    bool isFree(int i) {
+      return i < size && (bits[i / FREEBLOCK] >> (i % FREEBLOCK) & 1);
+    }
+    // runs of block i from its bits
+    void leaf(int i) {
+      uint64_t w = bits[i];
+      run& r = tree[leaves+i];
+      if (~w == 0) {
+        r.pre = r.suf = r.best = FREEBLOCK;
+        return;
+      }
+      r.pre = __builtin_ctzll(~w);
+      r.suf = __builtin_clzll(~w);
+      // each round shortens every run of ones by one
+      r.best = 0;
+      while (w != 0) {
+        w &= w >> 1;
+        r.best++;
+      }
+    }
+    void pull(int k, int half) {
+      const run& a = tree[2*k];
+      const run& b = tree[2*k+1];
+      run& c = tree[k];
+      c.pre = a.pre == half ? half + b.pre : a.pre;
+      c.suf = b.suf == half ? half + a.suf : b.suf;
+      c.best = std::max(std::max(a.best, b.best), a.suf + b.pre);
+    }
+    // first free run of len starting at from or later, in node k of
+    // cells [lo, lo+width), carry is the free run (from from) just
+    // before the cells searched; -1 if none here
+    int firstIn(int k, int lo, int width, int from, int len, int& carry) {
+      if (lo + width <= from) return -1;
+      const run& r = tree[k];
+      if (lo >= from && carry + r.pre < len && r.best < len) {
+        carry = r.pre == width ? carry + width : r.suf;
+        return -1;
+      }
+      if (width == FREEBLOCK) {
+        int i;
+        for (i=std::max(lo, from); i < lo+width; i++) {
+          if (!isFree(i)) carry = 0;
+          else if (++carry >= len) return i+1 - len;
+        }
+        return -1;
+      }
+      int half = width / 2;
+      int p = firstIn(2*k, lo, half, from, len, carry);
+      if (p >= 0) return p;
+      return firstIn(2*k+1, lo+half, half, from, len, carry);
+    }
+    // the same from the right, runs ending before end
+    int lastIn(int k, int lo, int width, int end, int len, int& carry) {
+      if (lo >= end) return -1;
+      const run& r = tree[k];
+      if (lo + width <= end && carry + r.suf < len && r.best < len) {
+        carry = r.suf == width ? carry + width : r.pre;
+        return -1;
+      }
+      if (width == FREEBLOCK) {
+        int i;
+        for (i=std::min(lo+width, end)-1; i >= lo; i--) {
+          if (!isFree(i)) carry = 0;
+          else if (++carry >= len) return i;
+        }
+        return -1;
+      }
+      int half = width / 2;
+      int p = lastIn(2*k+1, lo+half, half, end, len, carry);
+      if (p >= 0) return p;
+      return lastIn(2*k, lo, half, end, len, carry);
+    }
+  public:
+    int size;
+    
+    // all size cells free
+    FreeIndex(int n) {
+      size = n;
+      int blocks = (size + FREEBLOCK-1) / FREEBLOCK;
+      leaves = 1;
+      while (leaves < blocks) leaves *= 2;
+      bits.assign(blocks, 0);
+      run taken = { 0, 0, 0 };
+      tree.assign(2*leaves, taken);
+      set(0, size, true);
+    }
+    void set(int loc, int len, bool free) {
+      assert(loc >= 0 && len > 0 && loc+len <= size);
+      int first = loc / FREEBLOCK, last = (loc+len-1) / FREEBLOCK;
+      int i;
+      for (i=first; i <= last; i++) {
+        int lo = std::max(loc, i*FREEBLOCK) - i*FREEBLOCK;
+        int hi = std::min(loc+len, (i+1)*FREEBLOCK) - i*FREEBLOCK;
+        uint64_t mask = hi - lo == FREEBLOCK ? ~0ULL :
+                        ((1ULL << (hi - lo)) - 1) << lo;
+        if (free) bits[i] |= mask;
+        else bits[i] &= ~mask;
+        leaf(i);
+      }
+      int left = (leaves+first) / 2, right = (leaves+last) / 2;
+      int half = FREEBLOCK;
+      while (left >= 1) {
+        int k;
+        for (k=left; k <= right; k++)
+          pull(k, half);
+        left /= 2;
+        right /= 2;
+        half *= 2;
+      }
+    }
+    // start of the first free [p, p+len) with p >= from, -1 if none
+    int firstFit(int from, int len) {
+      int carry = 0;
+      return firstIn(1, 0, leaves*FREEBLOCK, from, len, carry);
+    }
+    // start of the last free [p, p+len) with p <= to, -1 if none
+    int lastFit(int to, int len) {
+      int carry = 0;
+      return lastIn(1, 0, leaves*FREEBLOCK, to + len, len, carry);
+    }
+    // start of the free [p, p+len) nearest loc (going round the end of
+    // memory), loc itself if free, -1 if there is none
+    int nearest(int loc, int len) {
+      int after = firstFit(loc, len);
+      int before = lastFit(loc, len);
+      if (after < 0) after = firstFit(0, len);
+      if (before < 0) before = lastFit(size-1, len);
+      if (after < 0) return -1;
+      int toAfter = after - loc;
+      if (toAfter < 0) toAfter += size;
+      int toBefore = loc - before;
+      if (toBefore < 0) toBefore += size;
+      return toBefore < toAfter ? before : after;
+    }
+};
+
+// memory ownership as an ordered set of extents
+// every allocation is one extent [start, start+len) with one owner,
+// cells not covered by any extent are free
+// extents never wrap, callers split at the end of memory
+class ExtentMap {
+  private:
+    struct extent {
+      int len;
+      ownerId owner;
+    };
+    std::map<int, extent> extents;
+    int freeCells;
+    // free runs, NULL unless asked for (see nearestFree())
+    FreeIndex* gaps;
+    
+    // extent containing i, or extents.end()
+    std::map<int, extent>::iterator find(int i) {
+      std::map<int, extent>::iterator it = extents.upper_bound(i);
+      if (it == extents.begin()) return extents.end();
+      --it;
+      if (it->first + it->second.len > i) return it;
+      return extents.end();
+    }
+  public:
+    ExtentMap(int size, bool index) {
+      freeCells = size;
+      gaps = index ? new FreeIndex(size) : NULL;
+    }
+    ~ExtentMap() {
+      delete gaps;
+    }
+    // owner of cell i, NOOWNER if free
+    ownerId owner(int i) {
+      std::map<int, extent>::iterator it = find(i);
+      if (it == extents.end()) return NOOWNER;
+      return it->second.owner;
+    }
+    // true if no cell of [loc, loc+len) is owned
+    bool isFree(int loc, int len) {
+      std::map<int, extent>::iterator it = extents.lower_bound(loc);
+      if (it != extents.end() && it->first < loc+len) return false;
+      if (it == extents.begin()) return true;
+      --it;
+      return it->first + it->second.len <= loc;
+    }
+    // true if every cell of [loc, loc+len) is owned by m
+    bool owned(int loc, int len, ownerId m) {
+      std::map<int, extent>::iterator it = find(loc);
+      int end = loc+len;
+      while (loc < end) {
+        if (it == extents.end() || it->first > loc || it->second.owner != m)
+          return false;
+        loc = it->first + it->second.len;
+        ++it;
+      }
+      return true;
+    }
+    // give free [loc, loc+len) to m
+    void insert(int loc, int len, ownerId m) {
+      assert(len > 0 && isFree(loc, len));
+      extent e = { len, m };
+      extents.insert(std::make_pair(loc, e));
+      freeCells -= len;
+      if (gaps != NULL) gaps->set(loc, len, false);
+    }
+    // free the extent starting at loc
+    void erase(int loc, int len) {
+      std::map<int, extent>::iterator it = extents.find(loc);
+      assert(it != extents.end() && it->second.len == len);
+      extents.erase(it);
+      freeCells += len;
+      if (gaps != NULL) gaps->set(loc, len, true);
+    }
+    // hand the extent starting at loc to m
+    void setOwner(int loc, ownerId m) {
+      std::map<int, extent>::iterator it = extents.find(loc);
+      assert(it != extents.end());
+      it->second.owner = m;
+    }
+    int available() {
+      return freeCells;
+    }
+    // start of the free [p, p+len) nearest loc, never wrapping, -1 if
+    // there is none (only with the index)
+    int nearestFree(int loc, int len) {
+      assert(gaps != NULL);
+      return gaps->nearest(loc, len);
+    }
+    // all extents in order as start, length, owner, for snapshots
+    void list(std::vector<int>& out) {
+      std::map<int, extent>::iterator it;
+      for (it = extents.begin(); it != extents.end(); ++it) {
+        out.push_back(it->first);
+        out.push_back(it->second.len);
+        out.push_back(it->second.owner);
+      }
+    }
+};
+
+// genotypes of a soup, told apart by a hash of the genome and its
+// size, labelled in order of first appearance. A genotype is dropped
+// once it is extinct and no genotype kept in the bank descends from
+// it, so the bank holds the live genotypes and their ancestry only.
+// Labels are never given out again, so a genome that comes back after
+// being dropped is a new genotype. Found through an open addressing
+// table with linear probing, kept at most half full
+struct genotype {
+  uint64_t hash;
+  int size;       // 0 for a free slot
+  int label;      // nth genotype of this size, printed as letters
+  int live;
+  long long total;
+  int firstStep;
+  int parent;     // genotype of the first one's parent, -1 if none
+  int children;   // genotypes in the bank with this one as parent
+};
+class Genebank {
+  private:
+    std::vector<genotype> types;
+    // index into types + 1 (0 empty), power of 2 long
+    std::vector<int> table;
+    // genotypes seen of each size
+    std::vector<int> perSize;
+    // free slots of types, a heap giving out the lowest first
+    std::vector<int> freeSlots;
+    long long seenTotal;
+    long long bornTotal;
+    
+    int& slotFor(uint64_t hash, int size) {
+      int mask = table.size() - 1;
+      int i = hash & mask;
+      while (table[i] != 0) {
+        genotype& g = types[table[i]-1];
+        if (g.hash == hash && g.size == size) break;
+        i = (i+1) & mask;
+      }
+      return table[i];
+    }
+    // take genotype i out of the table, moving back the entries after it
+    // that would no longer be found
+    void unlink(int i) {
+      int mask = table.size() - 1;
+      int j = types[i].hash & mask;
+      while (table[j] != i+1) j = (j+1) & mask;
+      table[j] = 0;
+      int k = j;
+      for (;;) {
+        k = (k+1) & mask;
+        if (table[k] == 0) return;
+        int home = types[table[k]-1].hash & mask;
+        // home cyclically in (j, k], found without passing j
+        if (j < k ? (home > j && home <= k) : (home > j || home <= k))
+          continue;
+        table[j] = table[k];
+        table[k] = 0;
+        j = k;
+      }
+    }
+    void rehash() {
+      std::fill(table.begin(), table.end(), 0);
+      int i;
+      for (i=0; i < (int)types.size(); i++)
+        if (types[i].size != 0) slotFor(types[i].hash, types[i].size) = i+1;
+    }
+    int add(const genotype& g) {
+      int i;
+      if (!freeSlots.empty()) {
+        std::pop_heap(freeSlots.begin(), freeSlots.end(), 
+                      std::greater<int>());
+        i = freeSlots.back();
+        freeSlots.pop_back();
+        types[i] = g;
+      } else {
+        i = types.size();
+        types.push_back(g);
+        if (2*types.size() > table.size()) {
+          table.resize(2*table.size());
+          rehash();
+        }
+      }
+      slotFor(g.hash, g.size) = i+1;
+      if (g.parent >= 0) types[g.parent].children++;
+      return i;
+    }
+    // drop i if it is extinct and has no descendants in the bank,
+    // then its parent if that leaves it the same, and so on
+    void release(int i) {
+      while (i >= 0 && types[i].live == 0 && types[i].children == 0) {
+        int parent = types[i].parent;
+        unlink(i);
+        types[i].size = 0;
+        freeSlots.push_back(i);
+        std::push_heap(freeSlots.begin(), freeSlots.end(), 
+                       std::greater<int>());
+        if (parent >= 0) types[parent].children--;
+        i = parent;
+      }
+    }
+  public:
+    Genebank() : table(1024, 0) {
+      seenTotal = 0;
+      bornTotal = 0;
+    }
+    
+    // slots, some of them free (size 0)
+    int size() {
+      return types.size();
+    }
+    genotype& operator[](int i) {
+      return types[i];
+    }
+    // genotypes and Machines there have ever been
+    long long seen() {
+      return seenTotal;
+    }
+    long long born() {
+      return bornTotal;
+    }
+    // a Machine of this genome is born, return its genotype
+    int birth(uint64_t hash, int size, int parent, int step) {
+      int i = slotFor(hash, size) - 1;
+      if (i < 0) {
+        genotype g = { hash, size, 0, 0, 0, step, parent, 0 };
+        if (size >= (int)perSize.size()) perSize.resize(size+1, 0);
+        g.label = perSize[size]++;
+        seenTotal++;
+        i = add(g);
+      }
+      types[i].live++;
+      types[i].total++;
+      bornTotal++;
+      return i;
+    }
+    void death(int i) {
+      assert(types[i].live > 0);
+      types[i].live--;
+      release(i);
+    }
+    // genotypes seen of each size (for snapshots)
+    const std::vector<int>& labels() {
+      return perSize;
+    }
+    // continue from a bank saved from size(), [], labels(), seen() and 
+    // born() (for snapshots)
+    void restore(const std::vector<genotype>& saved, 
+                 const std::vector<int>& sizes, long long seen, 
+                 long long born) {
+      types = saved;
+      table.assign(1024, 0);
+      while (2*types.size() > table.size()) table.resize(2*table.size());
+      rehash();
+      freeSlots.clear();
+      int i;
+      for (i=0; i < (int)types.size(); i++) {
+        types[i].children = 0;
+        if (types[i].size == 0) freeSlots.push_back(i);
+      }
+      std::make_heap(freeSlots.begin(), freeSlots.end(), 
+                     std::greater<int>());
+      for (i=0; i < (int)types.size(); i++)
+        if (types[i].size != 0 && types[i].parent >= 0) 
+          types[types[i].parent].children++;
+      perSize = sizes;
+      seenTotal = seen;
+      bornTotal = born;
     }
 };
 
@@ -231,6 +1095,22 @@ enum instr {
   LOAD, STORE, PUSH, POP ,
   INC , DEC  , ALU , RAND
 };
+#define NINSTR (RAND+1)
+
+// superinstructions, only ever found in code[]
+// each stands for a sequence of instructions starting with a PUSH
+enum superInstr {
+  PUSHLOAD = NINSTR, // PUSH n LOAD
+  PUSHSTORE,         // PUSH n STORE
+  PUSHALU,           // PUSH op ALU (op a valid operation)
+  INCREG,            // PUSH n LOAD INC PUSH m STORE
+  DECREG,            // PUSH n LOAD DEC PUSH m STORE
+  NCODES
+};
+
+#if defined(THREADED) && !defined(__GNUC__)
+#undef THREADED
+#endif
 // operations ALU can perform
 enum func {
   ADD, SUB, DIV, MUL,
@@ -238,18 +1118,316 @@ enum func {
   AND, OR , XOR
 };
 
+// Counters (COUNTERS)
+// Work done by each thread, summed and printed with every info dump:
+// instructions run by code (speculative runs included), faults, MAL
+// results, births, deaths, Machines reaped, and time spent in each phase
+// of run(). Without COUNTERS the COUNT and TIME hooks compile to nothing
+struct counters {
+  uint64_t ops[NCODES];
+  uint64_t faults[4];   // by execResult (see runCPU)
+  uint64_t execFaults;  // random instructions run
+  uint64_t copyFaults;  // random instructions written
+  uint64_t errorSteps;  // steps lost to errors
+  uint64_t malOk;
+  uint64_t malFailed;
+  uint64_t births;
+  uint64_t deaths;
+  uint64_t reaped;
+  // ns in each phase of run()
+  uint64_t timeReport;
+  uint64_t timeExecute;
+  uint64_t timeReaper;
+  uint64_t timeMigrate;
+  uint64_t timeSave;
+  std::chrono::steady_clock::time_point last;
+  
+  // add the time since the last tick to t
+  void tick(uint64_t& t) {
+    std::chrono::steady_clock::time_point now = 
+      std::chrono::steady_clock::now();
+    t += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      now - last).count();
+    last = now;
+  }
+  void add(const counters& c) {
+    int i;
+    for (i=0; i < NCODES; i++)
+      ops[i] += c.ops[i];
+    for (i=0; i < 4; i++)
+      faults[i] += c.faults[i];
+    execFaults += c.execFaults;
+    copyFaults += c.copyFaults;
+    errorSteps += c.errorSteps;
+    malOk += c.malOk;
+    malFailed += c.malFailed;
+    births += c.births;
+    deaths += c.deaths;
+    reaped += c.reaped;
+    timeReport += c.timeReport;
+    timeExecute += c.timeExecute;
+    timeReaper += c.timeReaper;
+    timeMigrate += c.timeMigrate;
+    timeSave += c.timeSave;
+  }
+};
+const char* codeNames[NCODES] = {
+  "NOP" , "MAL"  , "FORK", "COPY", "WRITE", "READ",
+  "DO"  , "LOOP" , "SLTZ", "SEZ" ,
+  "LOAD", "STORE", "PUSH", "POP" ,
+  "INC" , "DEC"  , "ALU" , "RAND",
+  "PUSHLOAD", "PUSHSTORE", "PUSHALU", "INCREG", "DECREG"
+};
+// counters of the running thread (threads without their own share these)
+counters spareCounters;
+thread_local counters* threadCounters = &spareCounters;
+// counts go to c for the life of this, then back where they went before
+struct countInto {
+  counters* saved;
+  countInto(counters& c) {
+    saved = threadCounters;
+    threadCounters = &c;
+  }
+  ~countInto() {
+    threadCounters = saved;
+  }
+};
+
+#ifdef COUNTERS
+#define COUNT(x)     (threadCounters->x++)
+#define COUNTN(x, n) (threadCounters->x += (n))
+#define TIME(x)      threadCounters->tick(threadCounters->x)
+#else
+#define COUNT(x)
+#define COUNTN(x, n)
+#define TIME(x)
+#endif
+
 // **************************************************************** //
-//                   Declare global variables
+//                       World (soup) state
 // **************************************************************** //
 
-// main memory space (array of signed bytes)
-signed char* memory = new signed char[MEMSIZE];
+// genome copied between islands (len 0 for none)
+struct genome {
+  int len;
+  signed char cells[MAXGENOME];
+};
+// each island may be a migration ahead of the next, so there must be
+// room for two migrations or the ring of islands could deadlock
+// (checked against MIGRANTS at startup)
+#define MIGRATEQUEUE 16
+typedef HandoffQueue<genome, MIGRATEQUEUE> migrationQueue;
+
+class Soup;
+class Reporter;
+class PhyloLog;
+class StateTrace;
+struct specLog;
+
+// Runs the Machines of a slice on several threads with the same result
+// as running them one by one in queue order.
+// Machines are taken in batches. A batch is first run speculatively,
+// side by side, against memory as it was at the start of the batch:
+// each Machine works on a copy of itself, notes the cells it reads and
+// buffers its writes (see specLog). The batch is then committed in queue
+// order. A Machine is rerun for real at its turn instead if an earlier
+// commit changed a cell it read, or if it needed MAL or FORK (which
+// change owners, the pool or the queue).
+class Scheduler {
+  private:
+    Soup* soup;
+    int numThreads;
+    std::vector<std::thread> helpers;
+    
+    // batch being run, logs[i] is the speculative run of batch[i]
+    std::vector<unsigned> batch;
+    specLog* logs;
+    int batchSize;
+    std::atomic<int> nextJob;
+    
+    // handing batches to the helper threads
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable finish;
+    int generation; // batches started
+    int working;    // helpers still on the current batch
+    bool quit;
+    
+    void speculate();
+    void helperLoop(int k);
+    void commit(int i);
+  public:
+    // counters of helper thread k (1 up, this thread counts in the Soup)
+    counters* helperCounts;
+    
+    Scheduler(Soup* s, int threads);
+    ~Scheduler();
+    int runSlice();
+    int threads() { return numThreads; }
+};
 
-// memory protections (array of Machine*)
-Machine** memProtect = new Machine*[MEMSIZE];
+// one world: memory, its owners and the Machines running in it
+// nothing here is shared, so each island can run its Soup on its own
+// thread, islands only meet through the migration queues
+class Soup {
+  public:
+    // settings of this Soup, a copy so the runs of a sweep can differ
+    // (in Soup methods cfg means this, not the global settings)
+    Config cfg;
+    
+    // memory size
+    int memSize;
+    
+    // main memory space (array of signed bytes)
+    signed char* memory;
+    
+    // decoded memory (instruction or superinstruction starting at each
+    // cell of memory, see decodeAt()), kept up to date by memWrite()
+    unsigned char* code;
+    
+    // memory protections (owned extents of memory)
+    ExtentMap* memProtect;
+    
+    // genotypes of the Machines born so far
+    Genebank genes;
+    
+    // Machines (every Machine owns at least MINSIZE cells of memory,
+    // so memSize/MINSIZE + 1 slots can never run out)
+    MachinePool* machines;
+    
+    // CPUs (Queue of Machine* in machines)
+    Queue<Machine*>* CPUs;
+    
+    // random numbers for the world itself (migration),
+    // Machines have their own
+    Rng rng;
+    
+    // genomes from the previous island and to the next
+    // (NULL when not running as islands)
+    migrationQueue* inbox;
+    migrationQueue* outbox;
+    
+    // where info is reported, and the phylogeny log (NULL for none)
+    Reporter& out;
+    PhyloLog* phylo;
+    
+    // state trace being recorded or checked (NULL for none)
+    StateTrace* trace;
+    
+    // memory at the last statistics report (empty before the first)
+    std::vector<signed char> lastStats;
+    
+    // counters of the thread running the Soup
+    counters counts;
+    
+    // runs Machines on several threads (NULL to run them one by one),
+    // changed[i] is the batch in which cell i (or the code or owner
+    // of it) last changed, see Scheduler
+    Scheduler* sched;
+    unsigned* changed;
+    unsigned batchNum;
+    
+    // next step run() will do, and the step of the last birth
+    int step;
+    int lastBirth;
+    
+    // snapshot file (empty for none), the thread writing the last one,
+    // and the mapping memory and code live in (zero pages, only taken
+    // as they are written, or a snapshot after a restore)
+    std::string snapName;
+    std::thread snapWriter;
+    char* mapBase;
+    size_t mapLen;
+    
+    Soup(int size, Reporter& o, const Config& c);
+    ~Soup();
+    
+    unsigned char decodeAt(int loc);
+    void memWrite(int loc, signed char cmd);
+    void memDecode(int loc, int len);
+    
+    int unwrappedLen(int loc, int len);
+    bool memOwned(int loc, int len, Machine* m);
+    bool memFree(int loc, int len);
+    void memAlloc(int loc, int len, Machine* m);
+    void memDealloc(int loc, int len);
+    void memTransfer(int loc, int len, Machine* m);
+    int memAvailable();
+    bool memWritable(int loc, Machine* m);
+    void touch(int loc, int len);
+    
+    bool createCPU(Machine* parent);
+    void killCPU();
+    template<bool SPEC, bool POW2, bool FIXED>
+      void runCPU(unsigned n, specLog* log);
+    // runCPU compiled for this Soup (see setShape()), for real and
+    // speculative runs
+    void (Soup::*runReal)(unsigned n, specLog* log);
+    void (Soup::*runSpec)(unsigned n, specLog* log);
+    void runLockstep(specLog* logs, int k);
+    void setShape();
+    void setThreads(int n);
+    
+    int generatePrimeval();
+    void initialise(uint64_t seed);
+    void emigrate();
+    void immigrate();
+    void run();
+    
+    void snapshot(snapBuffer& b);
+    void checkpoint();
+    bool restore(int fd);
+    bool restore(const char* file);
+    int fork();
+    void reseed(uint64_t seed);
+    void traceRecord(snapBuffer& b);
+    
+    void printMemory();
+    void printCPUInfo();
+    void printGenotypes();
+    void printCounters();
+    void printStats();
+    uint64_t genomeHash(int loc, int len);
+    void recordBirth(Machine* m, Machine* parent);
+    void recordDeath(Machine* m);
+};
 
-// CPUs (Queue of Machine* on heap)
-Queue<Machine*>* CPUs = new Queue<Machine*>();
+Soup::Soup(int size, Reporter& o, const Config& c) : cfg(c), out(o), 
+                                                     counts() {
+  memSize = size;
+  mapLen = 2*(size_t)memSize;
+  mapBase = (char*)mmap(NULL, mapLen, PROT_READ | PROT_WRITE, 
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapBase == MAP_FAILED) throw std::bad_alloc();
+  memory = (signed char*)mapBase;
+  code = (unsigned char*)(mapBase + memSize);
+  memProtect = new ExtentMap(memSize, cfg.malFit != 0);
+  {
+    long long slots = memSize/cfg.minSize + 1;
+    if (slots > MAXMACHINES) slots = MAXMACHINES;
+    machines = new MachinePool(slots, cfg.nRegs);
+  }
+  CPUs = new Queue<Machine*>();
+  inbox = NULL;
+  outbox = NULL;
+  phylo = NULL;
+  trace = NULL;
+  sched = NULL;
+  changed = NULL;
+  batchNum = 0;
+  step = 0;
+  lastBirth = 0;
+  setShape();
+}
+Soup::~Soup() {
+  if (snapWriter.joinable()) snapWriter.join();
+  delete sched;
+  delete[] changed;
+  delete CPUs;
+  delete machines;
+  delete memProtect;
+  munmap(mapBase, mapLen);
+}
 
 
 // **************************************************************** //
@@ -266,59 +1444,166 @@ int mapToRange(int val, int range) {
 }
 
 // **************************************************************** //
-// Memory protection functions
+// Memory contents
 
-bool memOwned(int loc, int len, Machine* m) {
-  assert(loc >= 0 && loc < MEMSIZE);
-  int i,j;
-  for (i=loc,j=0; j < len; i++,j++) {
-    if (i >= MEMSIZE) i=0;
-    if (memProtect[i] != m) return false;
+// instruction a cell holds, anything outside the instruction set is a NOP
+unsigned char decode(signed char cmd) {
+  if (cmd < 0 || cmd >= NINSTR) return NOP;
+  return cmd;
+}
+// longest sequence a superinstruction stands for
+#define MAXFUSED 7
+// entry of code[] for loc
+// sequences that would wrap around the end of memory are not fused
+unsigned char Soup::decodeAt(int loc) {
+  unsigned char op = decode(memory[loc]);
+#ifdef FUSION
+  if (op != PUSH || loc+3 > memSize) return op;
+  signed char arg = memory[loc+1];
+  switch (decode(memory[loc+2])) {
+    case LOAD:
+      if (loc+7 <= memSize && memory[loc+4] == PUSH && 
+          memory[loc+6] == STORE) {
+        if (memory[loc+3] == INC) return INCREG;
+        if (memory[loc+3] == DEC) return DECREG;
+      }
+      return PUSHLOAD;
+    case STORE:
+      return PUSHSTORE;
+    case ALU:
+      if (arg >= ADD && arg <= XOR) return PUSHALU;
+      return op;
+    default:
+      return op;
   }
-  return true;
+#else
+  return op;
+#endif
+}
+// all changes to memory after initialisation go through here
+void Soup::memWrite(int loc, signed char cmd) {
+  memory[loc] = cmd;
+  code[loc] = decodeAt(loc);
+  // sequences starting up to MAXFUSED-1 cells earlier may include loc
+  int i = loc - (MAXFUSED-1);
+  if (i < 0) i = 0;
+  touch(i, loc+1 - i);
+#ifdef FUSION
+  for (; i < loc; i++)
+    if (memory[i] == PUSH) code[i] = decodeAt(i);
+#endif
+}
+void Soup::memDecode(int loc, int len) {
+  int i;
+  for (i=loc; i < loc+len; i++)
+    code[i] = decodeAt(i);
+}
+
+// **************************************************************** //
+// Memory protection functions
+
+// Regions of memory are [loc, loc+len) and may wrap around the end,
+// the wrapped part is a separate extent in memProtect
+
+// length of [loc, loc+len) before it wraps
+int Soup::unwrappedLen(int loc, int len) {
+  if (loc + len > memSize) return memSize - loc;
+  return len;
+}
+bool Soup::memOwned(int loc, int len, Machine* m) {
+  assert(loc >= 0 && loc < memSize);
+  int n = unwrappedLen(loc, len);
+  if (!memProtect->owned(loc, n, m->id)) return false;
+  return n == len || memProtect->owned(0, len-n, m->id);
 }
-bool memFree(int loc, int len) {
-  assert(loc >= 0 && loc < MEMSIZE);
-  return memOwned(loc, len, NULL);
+bool Soup::memFree(int loc, int len) {
+  assert(loc >= 0 && loc < memSize);
+  int n = unwrappedLen(loc, len);
+  if (!memProtect->isFree(loc, n)) return false;
+  return n == len || memProtect->isFree(0, len-n);
 }
-void memAlloc(int loc, int len, Machine* m) {
-  assert(loc >= 0 && loc < MEMSIZE);
-  int i,j;
-  for (i=loc,j=0; j < len; i++,j++) {
-    if (i >= MEMSIZE) i=0;
-    memProtect[i] = m;
+void Soup::memAlloc(int loc, int len, Machine* m) {
+  assert(memFree(loc, len));
+  int n = unwrappedLen(loc, len);
+  memProtect->insert(loc, n, m->id);
+  touch(loc, n);
+  if (n < len) {
+    memProtect->insert(0, len-n, m->id);
+    touch(0, len-n);
   }
   assert(memOwned(loc, len, m));
 }
-void memDealloc(int loc, int len) {
-  memAlloc(loc, len, NULL);
+void Soup::memDealloc(int loc, int len) {
+  assert(loc >= 0 && loc < memSize);
+  int n = unwrappedLen(loc, len);
+  memProtect->erase(loc, n);
+  touch(loc, n);
+  if (n < len) {
+    memProtect->erase(0, len-n);
+    touch(0, len-n);
+  }
   assert(memFree(loc, len));
 }
-int memAvailable() {
-  int i,j;
-  for (i=0,j=0; i < MEMSIZE; i++) 
-    if (memProtect[i] == NULL) j++;
-  return j;
+// hand an allocated region to another Machine
+void Soup::memTransfer(int loc, int len, Machine* m) {
+  assert(loc >= 0 && loc < memSize);
+  int n = unwrappedLen(loc, len);
+  memProtect->setOwner(loc, m->id);
+  touch(loc, n);
+  if (n < len) {
+    memProtect->setOwner(0, m->id);
+    touch(0, len-n);
+  }
+  assert(memOwned(loc, len, m));
+}
+int Soup::memAvailable() {
+  return memProtect->available();
+}
+// true if m may write to cell loc (free, or owned by m)
+bool Soup::memWritable(int loc, Machine* m) {
+  // cheap check for the common case of m writing into its own regions
+  int d = loc - m->childLoc;
+  if (d < 0) d += memSize;
+  if (m->childLoc != -1 && d < m->childSize) return true;
+  d = loc - m->location;
+  if (d < 0) d += memSize;
+  if (d < m->mySize) return true;
+  
+  ownerId owner = memProtect->owner(loc);
+  return owner == NOOWNER || owner == m->id;
+}
+// note that [loc, loc+len) (not wrapping) changed, so Machines that read
+// it speculatively in this batch are rerun (see Scheduler)
+void Soup::touch(int loc, int len) {
+  if (changed == NULL) return;
+  int i;
+  for (i=loc; i < loc+len; i++)
+    changed[i] = batchNum;
 }
 
 // **************************************************************** //
 // Machine creation/deletion
 
-void createCPU(Machine* parent) {
+// Return false if there is no room for another Machine
+bool Soup::createCPU(Machine* parent) {
   int loc = parent->childLoc;
   int len = parent->childSize;
-  assert(loc >= 0 && loc < MEMSIZE);
+  assert(loc >= 0 && loc < memSize);
   assert(memOwned(loc, len, parent));
   
-  Machine* child = new Machine(loc, len);
+  Machine* child = machines->alloc(loc, len);
+  if (child == NULL) return false;
+  child->seed(parent->rng.next64(), cfg);
   CPUs->enqueue(child);
-  memAlloc(loc, len, child);
+  memTransfer(loc, len, child);
+  recordBirth(child, parent);
   
   parent->childLoc = -1;
   parent->childSize = -1;
+  return true;
 }
-void killCPU() {
-  Machine* m = CPUs->getHead()->val;
+void Soup::killCPU() {
+  Machine* m = (*CPUs)[CPUs->first()];
   
   int loc = m->location;
   int len = m->mySize;
@@ -330,224 +1615,989 @@ void killCPU() {
     assert(memOwned(m->childLoc, m->childSize, m));
     memDealloc(m->childLoc, m->childSize);
   }
+  recordDeath(m);
   CPUs->dequeue();
-  delete m;
+  machines->release(m);
+}
+
+// **************************************************************** //
+// Result of ALU operation op (ADD..XOR) on a and b
+// b must not be 0 for DIV
+
+short alu(short op, short a, short b) {
+  switch(static_cast<func>(op)) {
+    case ADD: return a + b;
+    case SUB: return a - b;
+    case DIV: return a / b;
+    case MUL: return a * b;
+    
+    case GRE: return a > b;
+    case LES: return a < b;
+    case EQU: return a == b;
+    
+    case AND: return a & b;
+    case OR:  return a | b;
+    case XOR: return a ^ b;
+  }
+  return 0;
 }
 
 // **************************************************************** //
-// Execution of 1 instruction for 1 machine
-// Return 0 if no errors, else number specific to error
+// Speculative run of a Machine (see Scheduler)
+// Holds a copy of the Machine, the cells of memory it read and the writes
+// it would have made. A full log, like anything only a real run can do,
+// ends the speculation (aborted) and the Machine is rerun for real.
 
-class ExecutionError {};
-int execute(Machine* m) {
-  instr i = static_cast<instr>(memory[m->IP]);
-  // execution error
-  if (rand()%ERRORCHANCE < 1) i = static_cast<instr>(rand()%20);
+// (sized for the default STEPSPERCYCLE, longer slices just abort more)
+#define MAXREADS (4*STEPSPERCYCLE)
+#define MAXWRITES STEPSPERCYCLE
+struct specLog {
+  Machine m;
+  bool aborted;
+  int promotes;
+  // steps run and error so far, when a run is taken over part way
+  // through its slice (see runLockstep)
+  int steps;
+  bool error;
+  int nReads;
+  int reads[MAXREADS];
+  int nWrites;
+  int wLoc[MAXWRITES];
+  signed char wVal[MAXWRITES];
   
-  try {
+  void clear(Machine* from) {
+    m = *from;
+    aborted = false;
+    promotes = 0;
+    steps = 0;
+    error = false;
+    nReads = 0;
+    nWrites = 0;
+  }
+  // note that cell loc (or its owner) was read
+  void read(int loc) {
+    if (nReads == MAXREADS) aborted = true;
+    else reads[nReads++] = loc;
+  }
+  // cell loc as the Machine sees it, after its own writes
+  signed char rd(signed char* memory, int loc) {
+    int j;
+    for (j=nWrites-1; j >= 0; j--)
+      if (wLoc[j] == loc) return wVal[j];
+    read(loc);
+    return memory[loc];
+  }
+  void write(int loc, signed char cmd) {
+    if (nWrites == MAXWRITES) aborted = true;
+    else {
+      wLoc[nWrites] = loc;
+      wVal[nWrites++] = cmd;
+    }
+  }
+  // note the fetch at loc, false to stop (code at loc may be stale
+  // because of the Machine's own writes, or already aborted)
+  bool fetch(int loc) {
+    int j;
+    for (j=0; j < nWrites; j++) {
+      int d = wLoc[j] - loc;
+      if (d >= 0 && d < MAXFUSED) aborted = true;
+    }
+    read(loc);
+    return !aborted;
+  }
+};
+
+// **************************************************************** //
+// Execution of 1 machine for 1 simulation step
+// Runs STEPSPERCYCLE instructions, every instruction after the first
+// error costs ERRORSTEPS more and promotes the machine in CPUs
+
+enum execResult {
+  EXEC_OK, STACK_UNDERFLOW, STACK_OVERFLOW, EXEC_ERROR
+};
+
+// Instruction dispatch
+// THREADED: jump straight from the end of one instruction to the next
+//           through a table of label addresses (computed goto)
+// otherwise: switch inside a loop
+#ifdef THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define OP(x)      op_##x
+#define NEXT       { ENDSTEP; DISPATCH; }
+#define DISPATCH   goto *labels[i]
+#else
+#define OP(x)      case x
+#define NEXT       goto stepDone
+#define DISPATCH   continue
+#endif
+// End of a stack or register instruction, only moves on and fetches
+// while in a burst (see BURST), the end of a basic block otherwise
+#define BNEXT      { BURSTSTEP; NEXT; }
+
+// Memory access, through the log when speculating
+#define RD(x)    (SPEC ? log->rd(memory, x) : memory[x])
+// cell of memory and register for an address
+#define MEMAT(x) (POW2 ? (x) & memMask : mapToRange(x, memSize))
+#define REGAT(x) mapToRange(x, nRegs)
+#define WR(x, v) if (SPEC) log->write(x, v); else memWrite(x, v)
+
+// Fetch the instruction at IP (maybe replaced by an execution error)
+#define FETCH \
+  if (SPEC && !log->fetch(m->IP)) return; \
+  i = code[m->IP]; \
+  if (--m->errorIn == 0) { \
+    i = decode(m->randomInstr()); \
+    m->errorIn = m->rng.geometric(cfg.errorChance); \
+    COUNT(execFaults); \
+  } \
+  COUNT(ops[i]);
+
+// End of an instruction: account for it, leave if out of steps,
+// then fetch the next one
+// once an error has occured every instruction promotes in CPUs queue
+// (so killed earlier) and reduces steps left
+#define ENDSTEP \
+  m->IP++; \
+  if (m->IP >= memSize) m->IP -= memSize; \
+  if (error) { \
+    if (SPEC) log->promotes++; \
+    else CPUs->promote(n); \
+    steps += errorSteps; \
+    COUNTN(errorSteps, errorSteps); \
+  } \
+  if (++steps >= slice) return; \
+  FETCH \
+  STARTBURST
+
+// Bursts (BURST)
+// An instruction ending without a fault can skip the checks of ENDSTEP
+// if the slice goes on and no execution fault is due: steps+1 < slice
+// and errorIn > 1. Both move by one each step (FUSED moves them
+// together), so steps+errorIn stays the same through a burst and one
+// test of steps against burstEnd does for all three checks. Execution
+// faults and the error flag only change in ENDSTEP, which sets burstEnd
+// again.
+#ifdef BURST
+#define STARTBURST \
+  burstEnd = error ? 0 : std::min(slice, steps + m->errorIn);
+#define BURSTSTEP \
+  if (steps + 1 < burstEnd) { \
+    m->IP++; \
+    if (m->IP >= memSize) m->IP -= memSize; \
+    steps++; \
+    if (SPEC && !log->fetch(m->IP)) return; \
+    i = code[m->IP]; \
+    m->errorIn--; \
+    COUNT(ops[i]); \
+    DISPATCH; \
+  }
+#else
+#define STARTBURST
+#define BURSTSTEP
+#endif
+
+// Superinstruction standing for k instructions may run
+#define FUSABLE(k) (!error && m->errorIn >= (k) && steps+(k) <= slice)
+// End of a superinstruction standing for k instructions over len cells
+#define FUSED(k, len) \
+  m->IP += (len)-1; \
+  steps += (k)-1; \
+  m->errorIn -= (k)-1; \
+  BNEXT
+
+// Stack access inside an instruction
+// End the instruction with error e (see execResult) if the access fails,
+// anything done by the instruction before the failure is kept
+#define FAULT(e)   { COUNT(faults[e]); error = true; goto stepDone; }
+#define DPOP(v)  if (!m->dataStack.pop(v))  FAULT(STACK_UNDERFLOW)
+#define DPUSH(v) if (!m->dataStack.push(v, dataDepth)) FAULT(STACK_OVERFLOW)
+#define LPOP(v)  if (!m->loopStack.pop(v))  FAULT(STACK_UNDERFLOW)
+#define LPUSH(v) if (!m->loopStack.push(v, loopDepth)) FAULT(STACK_OVERFLOW)
+
+// SPEC: speculative run into log (see Scheduler), otherwise a real run
+// POW2: memSize is a power of 2, addresses are masked instead of divided
+// FIXED: stack sizes, registers and steps are the compiled in defaults,
+//        so constants in the code
+template<bool SPEC, bool POW2, bool FIXED>
+void Soup::runCPU(unsigned n, specLog* log) {
+  Machine* m = SPEC ? &log->m : (*CPUs)[n];
+  assert(m != NULL);
+  const int dataDepth  = FIXED ? DATASTACKSIZE : cfg.dataStackSize;
+  const int loopDepth  = FIXED ? LOOPSTACKSIZE : cfg.loopStackSize;
+  const int nRegs      = FIXED ? NREGS : cfg.nRegs;
+  const int slice      = FIXED ? STEPSPERCYCLE : cfg.stepsPerCycle;
+  const int errorSteps = FIXED ? ERRORSTEPS : cfg.errorSteps;
+  const int memMask    = memSize - 1;
+  int steps = SPEC ? log->steps : 0;
+  bool error = SPEC && log->error;
+#ifdef BURST
+  int burstEnd;
+#endif
+  unsigned char i;
+  short a, b;
+  int l;
+#ifdef THREADED
+  static void* labels[NCODES] = {
+    &&op_NOP , &&op_MAL  , &&op_FORK, &&op_COPY, &&op_WRITE, &&op_READ,
+    &&op_DO  , &&op_LOOP , &&op_SLTZ, &&op_SEZ ,
+    &&op_LOAD, &&op_STORE, &&op_PUSH, &&op_POP ,
+    &&op_INC , &&op_DEC  , &&op_ALU , &&op_RAND,
+    &&op_PUSHLOAD, &&op_PUSHSTORE, &&op_PUSHALU, &&op_INCREG, &&op_DECREG
+  };
+  FETCH;
+  STARTBURST;
+  DISPATCH;
+  stepDone:
+  NEXT;
+  {
+#else
+  FETCH;
+  STARTBURST;
+  for (;;) {
+    /*std::cout << "IP: " << m->IP << "\n";
+    std::cout << "Instruction: " << (int)memory[m->IP] << "\n";
+    std::cout << "Datastack: "; m->dataStack.printStack();
+    std::cout << "Loopstack: "; m->loopStack.printStack();
+    std::cout << "Registers: "; printArray(m->reg, nRegs);*/
+    assert(m->IP >= 0 && m->IP < memSize);
+    
     switch(i) {
-      case NOP:
-        break;
-        
-      case MAL:
-      { if (m->childLoc != -1) {
-          assert(memOwned(m->childLoc, m->childSize, m));
-          memDealloc(m->childLoc, m->childSize);
-          m->childLoc = -1; m->childSize = -1;
-        }
-          
-        int start = mapToRange( m->dataStack->pop() + m->location, MEMSIZE);
-        int len = m->dataStack->pop();
-        
-        if (len > m->mySize*3 || len < MINSIZE || len > MAXSIZE) {
-          m->dataStack->push(0);
-          throw ExecutionError();
-        }
-        
-        if (memFree(start, len)) {
-          memAlloc(start, len, m);
-          m->childLoc = start;
-          m->childSize = len;
-          m->dataStack->push(1);
-        } else {
-          m->dataStack->push(0);
-          // don't throw error here
-          // as CPU has no way of knowing if memory is free...
-          //throw ExecutionError();
-        }
-        break;}
-        
-      case FORK:
-      { if (m->childLoc == -1) {m->dataStack->push(0); throw ExecutionError();}
-        createCPU(m);
-        m->dataStack->push(1);
-        break;}
-        
-      case COPY:
-      { int to =   mapToRange( m->dataStack->pop() + m->location, MEMSIZE);
-        int from = mapToRange( m->dataStack->pop() + m->location, MEMSIZE);
-        
-        if (memProtect[to] == NULL || memProtect[to] == m) {
-          memory[to] = memory[from];
-          // mutations
-          if (rand()%MUTCHANCE < 1) memory[to] = rand()%20;
-          m->dataStack->push(1);
-        } else {
-          m->dataStack->push(0);
-          throw ExecutionError();
-        }
-        break;}
-        
-      case WRITE:
-      { int to = mapToRange( m->dataStack->pop() + m->location, MEMSIZE);
-        signed char cmd = m->dataStack->pop();
-        
-        if (memProtect[to] == NULL || memProtect[to] == m) {
-          memory[to] = cmd;
-          // mutations
-          if (rand()%MUTCHANCE < 1) memory[to] = rand()%20;
-          m->dataStack->push(1);
-        } else {
-          m->dataStack->push(0);
-          throw ExecutionError();
-        }
-        break;}
-        
-      case READ:
-        m->dataStack->push( memory[ (m->dataStack->pop() + 
-                                  m->location) % MEMSIZE ] );
-        break;
-        
-      case DO:
-        m->loopStack->push( m->IP );
-        break;
-      case LOOP:
-        m->IP = m->loopStack->pop() - 1;
-        if (m->IP < 0) m->IP += MEMSIZE;
-        break;
-        
-      case SLTZ:
-        if (m->dataStack->pop() < 0) {
-          m->IP++;
-          if (m->IP >= MEMSIZE) m->IP -= MEMSIZE;
-          if (memory[m->IP] == LOOP) m->loopStack->pop();
+#endif
+    OP(NOP):
+      BNEXT;
+      
+    OP(MAL):
+    { if (SPEC) {
+        log->aborted = true;
+        return;
+      }
+      if (m->childLoc != -1) {
+        assert(memOwned(m->childLoc, m->childSize, m));
+        memDealloc(m->childLoc, m->childSize);
+        m->childLoc = -1; m->childSize = -1;
+      }
+      
+      DPOP(a); DPOP(b);
+      int start = MEMAT(a + m->location);
+      int len = b;
+      
+      if (len > m->mySize*3 || len < cfg.minSize || len > cfg.maxSize) {
+        COUNT(malFailed);
+        DPUSH(0);
+        FAULT(EXEC_ERROR);
+      }
+      
+      bool found = memFree(start, len);
+      if (!found && cfg.malFit) {
+        start = memProtect->nearestFree(start, len);
+        found = start >= 0;
+      }
+      if (found) {
+        COUNT(malOk);
+        memAlloc(start, len, m);
+        m->childLoc = start;
+        m->childSize = len;
+        DPUSH(1);
+      } else {
+        COUNT(malFailed);
+        DPUSH(0);
+        // don't return error here
+        // as CPU has no way of knowing if memory is free...
+        //FAULT(EXEC_ERROR);
+      }
+      NEXT;}
+      
+    OP(FORK):
+      if (SPEC) {
+        log->aborted = true;
+        return;
+      }
+      if (m->childLoc == -1 || !createCPU(m)) {DPUSH(0); FAULT(EXEC_ERROR);}
+      DPUSH(1);
+      NEXT;
+      
+    OP(COPY):
+    { DPOP(a); DPOP(b);
+      int to =   MEMAT(a + m->location);
+      int from = MEMAT(b + m->location);
+      
+      if (SPEC) log->read(to);
+      if (memWritable(to, m)) {
+        signed char cmd = RD(from);
+        // mutations
+        if (--m->mutateIn == 0) {
+          cmd = m->randomInstr();
+          m->mutateIn = m->rng.geometric(cfg.mutChance);
+          COUNT(copyFaults);
         }
-        break;
-      case SEZ:
-        if (m->dataStack->pop() == 0) {
-          m->IP++;
-          if (m->IP >= MEMSIZE) m->IP -= MEMSIZE;
-          if (memory[m->IP] == LOOP) m->loopStack->pop();
+        WR(to, cmd);
+        DPUSH(1);
+      } else {
+        DPUSH(0);
+        FAULT(EXEC_ERROR);
+      }
+      NEXT;}
+      
+    OP(WRITE):
+    { DPOP(a); DPOP(b);
+      int to = MEMAT(a + m->location);
+      signed char cmd = b;
+      
+      if (SPEC) log->read(to);
+      if (memWritable(to, m)) {
+        // mutations
+        if (--m->mutateIn == 0) {
+          cmd = m->randomInstr();
+          m->mutateIn = m->rng.geometric(cfg.mutChance);
+          COUNT(copyFaults);
         }
-        break;
-        
-      case LOAD:
-      { int regNum = mapToRange( m->dataStack->pop() + m->location, NREGS);
-        m->dataStack->push( m->reg[regNum] );
-        break;}
-      case STORE:
-      { int regNum = mapToRange( m->dataStack->pop() + m->location, NREGS);
-        m->reg[regNum] = m->dataStack->pop();
-        break;}
-        
-      case PUSH:
-      { m->IP++;
-        if (m->IP >= MEMSIZE) m->IP -= MEMSIZE;
-        m->dataStack->push( memory[m->IP] );
-        break;}
-      case POP:
-        m->dataStack->pop();
-        break;
-        
-      case INC:
-        m->dataStack->push( m->dataStack->pop() + 1 );
-        break;
-      case DEC:
-        m->dataStack->push( m->dataStack->pop() - 1 );
-        break;
-        
-      case ALU:
-        {
-          func op = static_cast<func>(m->dataStack->pop());
-          switch(op) {
-            case ADD:
-              m->dataStack->push( 
-                  m->dataStack->pop() + m->dataStack->pop() );
-              break;
-            case SUB:
-              m->dataStack->push( 
-                  m->dataStack->pop() - m->dataStack->pop() );
-              break;
-            case DIV:
-            { int a = m->dataStack->pop();
-              int b = m->dataStack->pop();
-              if (b == 0) {
-                m->dataStack->push(0);
-                throw ExecutionError();
-              }
-              m->dataStack->push( a / b );
-              break;}
-            case MUL:
-              m->dataStack->push( 
-                  m->dataStack->pop() * m->dataStack->pop() );
-              break;
-              
-            case GRE:
-              m->dataStack->push( 
-                  m->dataStack->pop() > m->dataStack->pop() );
-              break;
-            case LES:
-              m->dataStack->push( 
-                  m->dataStack->pop() < m->dataStack->pop() );
-              break;
-            case EQU:
-              m->dataStack->push( 
-                  m->dataStack->pop() == m->dataStack->pop() );
-              break;
-               
-            case AND:
-              m->dataStack->push( 
-                  m->dataStack->pop() & m->dataStack->pop() );
-              break;
-            case OR:
-              m->dataStack->push( 
-                  m->dataStack->pop() | m->dataStack->pop() );
-              break;
-            case XOR:
-              m->dataStack->push( 
-                  m->dataStack->pop() ^ m->dataStack->pop() );
-              break;
-            default:
-              break;
+        WR(to, cmd);
+        DPUSH(1);
+      } else {
+        DPUSH(0);
+        FAULT(EXEC_ERROR);
+      }
+      NEXT;}
+      
+    OP(READ):
+      DPOP(a);
+      DPUSH( RD(MEMAT(a + m->location)) );
+      NEXT;
+      
+    OP(DO):
+      LPUSH( m->IP );
+      NEXT;
+    OP(LOOP):
+      LPOP(l);
+      m->IP = l - 1;
+      if (m->IP < 0) m->IP += memSize;
+      NEXT;
+      
+    OP(SLTZ):
+      DPOP(a);
+      if (a < 0) {
+        m->IP++;
+        if (m->IP >= memSize) m->IP -= memSize;
+        if (RD(m->IP) == LOOP) LPOP(l);
+      }
+      BNEXT;
+    OP(SEZ):
+      DPOP(a);
+      if (a == 0) {
+        m->IP++;
+        if (m->IP >= memSize) m->IP -= memSize;
+        if (RD(m->IP) == LOOP) LPOP(l);
+      }
+      BNEXT;
+      
+    OP(LOAD):
+    { DPOP(a);
+      int regNum = REGAT(a + m->location);
+      DPUSH( m->reg[regNum] );
+      BNEXT;}
+    OP(STORE):
+    { DPOP(a);
+      int regNum = REGAT(a + m->location);
+      DPOP(b);
+      m->reg[regNum] = b;
+      BNEXT;}
+      
+    OP(PUSH):
+    pushOp:
+      m->IP++;
+      if (m->IP >= memSize) m->IP -= memSize;
+      DPUSH( RD(m->IP) );
+      BNEXT;
+    OP(POP):
+      DPOP(a);
+      BNEXT;
+      
+    OP(INC):
+      DPOP(a);
+      DPUSH( a + 1 );
+      BNEXT;
+    OP(DEC):
+      DPOP(a);
+      DPUSH( a - 1 );
+      BNEXT;
+      
+    OP(ALU):
+    { short op;
+      DPOP(op);
+      // unknown operations do nothing
+      if (op < ADD || op > XOR) BNEXT;
+      // a = first pop, b = second pop, push a OP b
+      DPOP(a); DPOP(b);
+      if (op == DIV && b == 0) {
+        DPUSH(0);
+        FAULT(EXEC_ERROR);
+      }
+      DPUSH( alu(op, a, b) );
+      BNEXT;}
+    
+    OP(RAND):
+      DPUSH(m->rng.next());
+      BNEXT;
+      
+    // Superinstructions
+    // Only taken if the whole sequence would run without a fault, error
+    // or the slice ending part way, otherwise the leading PUSH is run
+    // on its own. The IP, steps and fault countdown end up exactly as
+    // if the instructions had been run one by one.
+    OP(PUSHLOAD):
+      if (!FUSABLE(2) || m->dataStack.size() == dataDepth) goto pushOp;
+      a = memory[m->IP+1];
+      m->dataStack.push( m->reg[REGAT(a + m->location)] );
+      FUSED(2, 3);
+    OP(PUSHSTORE):
+      if (!FUSABLE(2) || m->dataStack.size() == 0 || 
+          m->dataStack.size() == dataDepth) goto pushOp;
+      a = memory[m->IP+1];
+      m->dataStack.pop(b);
+      m->reg[REGAT(a + m->location)] = b;
+      FUSED(2, 3);
+    OP(PUSHALU):
+      if (!FUSABLE(2) || m->dataStack.size() < 2 || 
+          m->dataStack.size() == dataDepth) goto pushOp;
+      a = memory[m->IP+1];
+      if (a == DIV && m->dataStack.peek(1) == 0) goto pushOp;
+      { short x, y;
+        m->dataStack.pop(x);
+        m->dataStack.pop(y);
+        m->dataStack.push( alu(a, x, y) );
+      }
+      FUSED(2, 3);
+    OP(INCREG):
+    OP(DECREG):
+      if (!FUSABLE(5) || m->dataStack.size()+2 > dataDepth) goto pushOp;
+      a = memory[m->IP+1];
+      b = memory[m->IP+5];
+      m->reg[REGAT(b + m->location)] = 
+        m->reg[REGAT(a + m->location)] + (i == INCREG ? 1 : -1);
+      FUSED(5, 7);
+    }
+#ifndef THREADED
+    stepDone:
+    ENDSTEP;
+  }
+#endif
+}
+
+#undef OP
+#undef NEXT
+#undef RD
+#undef WR
+#undef MEMAT
+#undef REGAT
+#undef DISPATCH
+#undef ENDSTEP
+#undef BNEXT
+#undef STARTBURST
+#undef BURSTSTEP
+#undef FUSABLE
+#undef FUSED
+#undef FAULT
+#undef DPOP
+#undef DPUSH
+#undef LPOP
+#undef LPUSH
+#ifdef THREADED
+#pragma GCC diagnostic pop
+#endif
+
+// **************************************************************** //
+// Speculative runs of up to LANES Machines in lockstep (LOCKSTEP=1)
+// Each round runs one instruction of every Machine. The Machines are
+// held as a structure of arrays, lane j of each array is Machine j, so
+// what every instruction does (IP, steps, errors) is done for all lanes
+// at once over whole arrays, and the rest for the lanes running each
+// instruction together. When the lanes of PUSH, POP, INC or DEC all
+// have the same depth of data stack, as clones in phase do, no lane can
+// fault and the instruction is done for them at once with masked
+// updates of whole rows, which the compiler turns into vector
+// instructions (only PUSH's reads of memory, which are logged, go lane
+// by lane). Superinstructions are run as their leading PUSH, which ends
+// the same. A lane at COPY or WRITE, or due an
+// execution fault, leaves the lockstep: it goes back into its Machine
+// and runCPU runs the rest of its slice. MAL and FORK abort, as in any
+// speculative run. Logs end exactly as runSpec would leave them.
+
+#define LANES 16
+
+struct lockstepLanes {
+  specLog* log[LANES];
+  int ran[LANES];       // 1 if it ran an instruction this round
+  int leaving[LANES];   // 1 if it leaves before its next instruction
+  int IP[LANES];
+  int steps[LANES];
+  int error[LANES];     // 1 after an error
+  int promotes[LANES];
+  int errorIn[LANES];
+  int location[LANES];
+  short reg[MAXREGS][LANES];
+  int dataTop[LANES];
+  short data[MAXSTACK][LANES];
+  int loopTop[LANES];
+  int loop[MAXSTACK][LANES];
+  // -1 for the lanes of the group being run, 0 for the others
+  short mask16[LANES];
+  int mask32[LANES];
+  
+  // masks of the n lanes in g, return their data stack depth if they
+  // all have the same, -1 if not
+  int select(const int* g, int n) {
+    int j;
+    for (j=0; j < LANES; j++) {
+      mask16[j] = 0;
+      mask32[j] = 0;
+    }
+    int depth = dataTop[g[0]];
+    for (j=0; j < n; j++) {
+      mask16[g[j]] = -1;
+      mask32[g[j]] = -1;
+      if (dataTop[g[j]] != depth) depth = -1;
+    }
+    return depth;
+  }
+};
+
+// Stack access of lane j inside an instruction, as DPOP and so on in
+// runCPU, a fault ends the instruction of that lane
+#define FAULT(e)   { COUNT(faults[e]); s.error[j] = 1; continue; }
+#define DPOP(v) \
+  if (s.dataTop[j] == 0) FAULT(STACK_UNDERFLOW) \
+  v = s.data[--s.dataTop[j]][j]
+#define DPUSH(v) \
+  { short pushed = (v); \
+    if (s.dataTop[j] == dataDepth) FAULT(STACK_OVERFLOW) \
+    s.data[s.dataTop[j]++][j] = pushed; }
+#define LPOP(v) \
+  if (s.loopTop[j] == 0) FAULT(STACK_UNDERFLOW) \
+  v = s.loop[--s.loopTop[j]][j]
+#define LPUSH(v) \
+  if (s.loopTop[j] == loopDepth) FAULT(STACK_OVERFLOW) \
+  s.loop[s.loopTop[j]++][j] = v
+#define RD(x) s.log[j]->rd(memory, x)
+
+void Soup::runLockstep(specLog* logs, int k) {
+  const int dataDepth  = cfg.dataStackSize;
+  const int loopDepth  = cfg.loopStackSize;
+  const int nRegs      = cfg.nRegs;
+  const int slice      = cfg.stepsPerCycle;
+  const int errorSteps = cfg.errorSteps;
+  lockstepLanes s;
+  int j, r;
+  
+  // Machines into lanes, lanes still in the lockstep in active
+  int active[LANES];
+  int numActive = k;
+  for (j=0; j < LANES; j++) {
+    s.IP[j] = 0;
+    s.steps[j] = 0;
+    s.error[j] = 0;
+    s.promotes[j] = 0;
+    s.leaving[j] = 0;
+  }
+  for (j=0; j < k; j++) {
+    active[j] = j;
+    Machine& m = logs[j].m;
+    s.log[j] = &logs[j];
+    s.IP[j] = m.IP;
+    s.errorIn[j] = m.errorIn;
+    s.location[j] = m.location;
+    for (r=0; r < nRegs; r++)
+      s.reg[r][j] = m.reg[r];
+    s.dataTop[j] = m.dataStack.size();
+    for (r=0; r < s.dataTop[j]; r++)
+      s.data[r][j] = m.dataStack.peek(s.dataTop[j]-1-r);
+    s.loopTop[j] = m.loopStack.size();
+    for (r=0; r < s.loopTop[j]; r++)
+      s.loop[r][j] = m.loopStack.peek(s.loopTop[j]-1-r);
+  }
+  
+  // lanes of each instruction this round, and the instructions
+  int group[NINSTR][LANES];
+  int groupSize[NINSTR];
+  int ran[NINSTR];
+  for (r=0; r < NINSTR; r++)
+    groupSize[r] = 0;
+  while (numActive > 0) {
+    // fetch, lanes grouped by instruction
+    int numRan = 0;
+    int a;
+    for (j=0; j < LANES; j++)
+      s.ran[j] = 0;
+    for (a=0; a < numActive; a++) {
+      j = active[a];
+      unsigned char i = code[s.IP[j]];
+      if (i >= NINSTR) i = PUSH;
+      if (i == COPY || i == WRITE || s.errorIn[j] == 1) {
+        s.leaving[j] = 1;
+        continue;
+      }
+      if (!s.log[j]->fetch(s.IP[j])) continue;
+      s.errorIn[j]--;
+      s.ran[j] = 1;
+      COUNT(ops[i]);
+      if (groupSize[i] == 0) ran[numRan++] = i;
+      group[i][groupSize[i]++] = j;
+    }
+    
+    // each instruction for its lanes
+    int y;
+    for (y=0; y < numRan; y++) {
+      int i = ran[y];
+      int* g = group[i];
+      int n = groupSize[i];
+      int x;
+      groupSize[i] = 0;
+      short a, b;
+      int l, d;
+      switch (i) {
+        case NOP:
+          break;
+        case MAL:
+        case FORK:
+          for (x=0; x < n; x++)
+            s.log[g[x]]->aborted = true;
+          break;
+        case COPY:
+        case WRITE:
+          assert(n == 0);
+          break;
+        case READ:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+            DPUSH( RD(mapToRange(a + s.location[j], memSize)) );
           }
           break;
-        }
-      
-      case RAND:
-        m->dataStack->push(rand());
-        break;
-        
-      default:
-        break;
-    }
-  } catch (StackUnderflow) {
-    //std::cout << "StackUnderError\n";
-    return 1;
-  } catch (StackOverflow) {
-    //std::cout << "StackOverError\n";
-    return 2;
-  } catch (ExecutionError) {
-    //std::cout << "GeneralError\n";
-    return 3;
+        case DO:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            LPUSH( s.IP[j] );
+          }
+          break;
+        case LOOP:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            LPOP(l);
+            s.IP[j] = l - 1;
+            if (s.IP[j] < 0) s.IP[j] += memSize;
+          }
+          break;
+        case SLTZ:
+        case SEZ:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+            if (i == SLTZ ? a < 0 : a == 0) {
+              s.IP[j]++;
+              if (s.IP[j] >= memSize) s.IP[j] -= memSize;
+              if (RD(s.IP[j]) == LOOP) { LPOP(l); }
+            }
+          }
+          break;
+        case LOAD:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+            DPUSH( s.reg[mapToRange(a + s.location[j], nRegs)][j] );
+          }
+          break;
+        case STORE:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+            r = mapToRange(a + s.location[j], nRegs);
+            DPOP(b);
+            s.reg[r][j] = b;
+          }
+          break;
+        case PUSH:
+          d = s.select(g, n);
+          if (d >= 0 && d < dataDepth) {
+            for (j=0; j < LANES; j++) {
+              int ip = s.IP[j] - s.mask32[j];
+              s.IP[j] = ip >= memSize ? ip - memSize : ip;
+              s.dataTop[j] -= s.mask32[j];
+            }
+            for (x=0; x < n; x++) {
+              j = g[x];
+              s.data[d][j] = RD(s.IP[j]);
+            }
+            break;
+          }
+          for (x=0; x < n; x++) {
+            j = g[x];
+            s.IP[j]++;
+            if (s.IP[j] >= memSize) s.IP[j] -= memSize;
+            DPUSH( RD(s.IP[j]) );
+          }
+          break;
+        case POP:
+          d = s.select(g, n);
+          if (d >= 1) {
+            for (j=0; j < LANES; j++)
+              s.dataTop[j] += s.mask32[j];
+            break;
+          }
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+          }
+          break;
+        case INC:
+        case DEC:
+          d = s.select(g, n);
+          if (d >= 1) {
+            if (i == INC)
+              for (j=0; j < LANES; j++) s.data[d-1][j] -= s.mask16[j];
+            else 
+              for (j=0; j < LANES; j++) s.data[d-1][j] += s.mask16[j];
+            break;
+          }
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPOP(a);
+            DPUSH( i == INC ? a + 1 : a - 1 );
+          }
+          break;
+        case ALU:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            short op;
+            DPOP(op);
+            if (op < ADD || op > XOR) continue;
+            DPOP(a); DPOP(b);
+            if (op == DIV && b == 0) {
+              DPUSH(0);
+              FAULT(EXEC_ERROR);
+            }
+            DPUSH( alu(op, a, b) );
+          }
+          break;
+        case RAND:
+          for (x=0; x < n; x++) {
+            j = g[x];
+            DPUSH( s.log[j]->m.rng.next() );
+          }
+          break;
+      }
+    }
+    
+    // end of the instruction of every lane that ran one (as ENDSTEP)
+    for (j=0; j < LANES; j++) {
+      int ip = s.IP[j] + s.ran[j];
+      s.IP[j] = ip >= memSize ? ip - memSize : ip;
+      s.promotes[j] += s.ran[j] & s.error[j];
+      s.steps[j] += s.ran[j] * (1 + s.error[j] * errorSteps);
+    }
+    
+    // aborted lanes stop, lanes out of steps or leaving go back into
+    // their Machines, and runCPU finishes the slice of those leaving
+    int kept = 0;
+    for (a=0; a < numActive; a++) {
+      j = active[a];
+      if (s.log[j]->aborted) continue;
+      if (s.steps[j] < slice && !s.leaving[j]) {
+        active[kept++] = j;
+        continue;
+      }
+      specLog* log = s.log[j];
+      Machine& m = log->m;
+      m.IP = s.IP[j];
+      m.errorIn = s.errorIn[j];
+      for (r=0; r < nRegs; r++)
+        m.reg[r] = s.reg[r][j];
+      m.dataStack.resetStack();
+      for (r=0; r < s.dataTop[j]; r++)
+        m.dataStack.push(s.data[r][j]);
+      m.loopStack.resetStack();
+      for (r=0; r < s.loopTop[j]; r++)
+        m.loopStack.push(s.loop[r][j]);
+      log->steps = s.steps[j];
+      log->error = s.error[j];
+      log->promotes = s.promotes[j];
+      COUNTN(errorSteps, s.promotes[j] * errorSteps);
+      if (s.leaving[j]) (this->*runSpec)(0, log);
+    }
+    numActive = kept;
+  }
+}
+
+#undef FAULT
+#undef DPOP
+#undef DPUSH
+#undef LPOP
+#undef LPUSH
+#undef RD
+
+// **************************************************************** //
+// Parallel execution of the Machines of a slice (see Scheduler)
+
+Scheduler::Scheduler(Soup* s, int threads) {
+  soup = s;
+  numThreads = threads;
+  batch.resize(soup->cfg.maxAlive);
+  logs = new specLog[soup->cfg.maxAlive];
+  batchSize = 0;
+  generation = 0;
+  working = 0;
+  quit = false;
+  // this thread runs a share of each batch too
+  int i;
+  helperCounts = new counters[numThreads]();
+  for (i=1; i < numThreads; i++)
+    helpers.push_back(std::thread(&Scheduler::helperLoop, this, i));
+}
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  start.notify_all();
+  int i;
+  for (i=0; i < (int)helpers.size(); i++)
+    helpers[i].join();
+  delete[] logs;
+  delete[] helperCounts;
+}
+// Speculatively run Machines of the batch until none are left
+// (LANES at a time in lockstep with LOCKSTEP=1)
+void Scheduler::speculate() {
+  int width = soup->cfg.lockstep ? LANES : 1;
+  for (;;) {
+    int i = nextJob.fetch_add(width);
+    if (i >= batchSize) return;
+    int k = std::min(width, batchSize - i);
+    int j;
+    for (j=i; j < i+k; j++)
+      logs[j].clear((*soup->CPUs)[batch[j]]);
+    if (soup->cfg.lockstep) soup->runLockstep(&logs[i], k);
+    else (soup->*soup->runSpec)(batch[i], &logs[i]);
+  }
+}
+void Scheduler::helperLoop(int k) {
+  countInto guard(helperCounts[k]);
+  int seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while (generation == seen && !quit) start.wait(guard);
+      if (quit) return;
+      seen = generation;
+    }
+    speculate();
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (--working == 0) finish.notify_one();
+    }
+  }
+}
+// Apply the speculative run of batch[i] if nothing it read has changed
+// since the batch started, otherwise rerun it for real
+void Scheduler::commit(int i) {
+  specLog& log = logs[i];
+  unsigned n = batch[i];
+  // only the Machine itself can move from its place before its turn
+  assert((*soup->CPUs)[n]->id == log.m.id);
+  
+  bool valid = !log.aborted;
+  int j;
+  for (j=0; valid && j < log.nReads; j++)
+    if (soup->changed[log.reads[j]] == soup->batchNum) valid = false;
+  if (!valid) {
+    (soup->*soup->runReal)(n, NULL);
+    return;
+  }
+  for (j=0; j < log.nWrites; j++)
+    soup->memWrite(log.wLoc[j], log.wVal[j]);
+  *(*soup->CPUs)[n] = log.m;
+  for (j=0; j < log.promotes; j++)
+    soup->CPUs->promote(n);
+}
+// Run the first MAXALIVE Machines in CPUs, as the serial loop would,
+// and return how many ran
+int Scheduler::runSlice() {
+  int numAlive = 0;
+  Queue<Machine*>* CPUs = soup->CPUs;
+  unsigned current = CPUs->first();
+  while (current != CPUs->end() && numAlive < soup->cfg.maxAlive) {
+    batchSize = 0;
+    while (current != CPUs->end() && 
+           numAlive + batchSize < soup->cfg.maxAlive)
+      batch[batchSize++] = current++;
+    // new batch number, so every cell counts as unchanged
+    if (++soup->batchNum == 0) {
+      int i;
+      for (i=0; i < soup->memSize; i++)
+        soup->changed[i] = 0;
+      soup->batchNum = 1;
+    }
+    
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      nextJob = 0;
+      working = numThreads-1;
+      generation++;
+    }
+    start.notify_all();
+    speculate();
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while (working > 0) finish.wait(guard);
+    }
+    
+    int i;
+    for (i=0; i < batchSize; i++)
+      commit(i);
+    numAlive += batchSize;
+    // Machines born in this batch join the queue after it
+    current = batch[batchSize-1] + 1;
+  }
+  return numAlive;
+}
+
+// Pick the runCPU compiled for this Soup's memory size and cfg,
+// done once so the interpreter itself never checks
+void Soup::setShape() {
+  bool pow2 = (memSize & (memSize-1)) == 0;
+  bool fixed = cfg.dataStackSize == DATASTACKSIZE && 
+               cfg.loopStackSize == LOOPSTACKSIZE && cfg.nRegs == NREGS &&
+               cfg.stepsPerCycle == STEPSPERCYCLE && 
+               cfg.errorSteps == ERRORSTEPS;
+  if (pow2 && fixed) {
+    runReal = &Soup::runCPU<false, true, true>;
+    runSpec = &Soup::runCPU<true, true, true>;
+  } else if (pow2) {
+    runReal = &Soup::runCPU<false, true, false>;
+    runSpec = &Soup::runCPU<true, true, false>;
+  } else if (fixed) {
+    runReal = &Soup::runCPU<false, false, true>;
+    runSpec = &Soup::runCPU<true, false, true>;
+  } else {
+    runReal = &Soup::runCPU<false, false, false>;
+    runSpec = &Soup::runCPU<true, false, false>;
   }
-  return 0;
+}
+
+// Run this Soup's Machines on n threads
+// (through the Scheduler even on one with LOCKSTEP=1)
+void Soup::setThreads(int n) {
+  delete sched;
+  sched = NULL;
+  if (n <= 1 && !cfg.lockstep) return;
+  if (changed == NULL) changed = new unsigned[memSize]();
+  sched = new Scheduler(this, n);
 }
 
 // **************************************************************** //
 // Generation of seed Machine
 // Return length of Machine
 
-int generatePrimeval() {
+int Soup::generatePrimeval() {
   int i = 0;
   /*
     // Length measure loop
@@ -795,211 +2845,2274 @@ int generatePrimeval() {
   memory[i++] = NOP;
   memory[i++] = NOP; 
   
+  assert(i == PRIMEVALSIZE);
   return i;
 }
 
 // **************************************************************** //
 // Initialisation of world
 // Generate seed and give it a CPU
+// Every later random number descends from the seed given here
 
-void initialise() {
+void Soup::initialise(uint64_t seed) {
+  // a stream apart from the primeval's
+  rng.seed(~seed);
   int i = generatePrimeval();
-  Machine* m = new Machine(0, i);
+  memDecode(0, memSize);
+  Machine* m = machines->alloc(0, i);
+  m->seed(seed, cfg);
   CPUs->enqueue(m);
   memAlloc(0, i, m);
+  recordBirth(m, NULL);
 }
 
 // **************************************************************** //
-// Display memory to stdout
-// Shows memory protection, memory contents and Machine locations
+// Migration between islands
+// Every island sends before it receives and always sends MIGRANTS
+// genomes, so each island takes in the same genomes on every run
+
+// Copy MIGRANTS randomly chosen genomes to the next island
+void Soup::emigrate() {
+  int count = CPUs->size();
+  
+  int k;
+  for (k=0; k < cfg.migrants; k++) {
+    genome g;
+    g.len = 0;
+    if (count > 0) {
+      Machine* m = (*CPUs)[CPUs->first() + rng.below(count)];
+      assert(m->mySize <= MAXGENOME);
+      g.len = m->mySize;
+      int j;
+      for (j=0; j < g.len; j++)
+        g.cells[j] = memory[mapToRange(m->location + j, memSize)];
+    }
+    while (!outbox->push(g))
+      std::this_thread::yield();
+  }
+}
+// Give each genome sent by the previous island a new Machine
+// at a random free place, dropped if no place is found
+void Soup::immigrate() {
+  int k;
+  for (k=0; k < cfg.migrants; k++) {
+    genome g;
+    // wait for the previous island to catch up
+    while (!inbox->pop(g))
+      std::this_thread::yield();
+    if (g.len == 0) continue;
+    
+    int tries;
+    for (tries=0; tries < cfg.migrateTries; tries++) {
+      int loc = rng.below(memSize);
+      if (!memFree(loc, g.len)) continue;
+      
+      Machine* m = machines->alloc(loc, g.len);
+      if (m == NULL) break;
+      m->seed(rng.next64(), cfg);
+      int j;
+      for (j=0; j < g.len; j++)
+        memWrite(mapToRange(loc + j, memSize), g.cells[j]);
+      CPUs->enqueue(m);
+      memAlloc(loc, g.len, m);
+      recordBirth(m, NULL);
+      break;
+    }
+  }
+}
+
+// **************************************************************** //
+// Phylogeny log (PHYLOGENY=1)
+// Every birth and death, appended to phylo.bin (or phylo0.bin... for
+// islands) and read by Phylo.cpp. Machines are known by their birth
+// number, 1 for the first born, 0 for none.
+// File: magic, version, then blocks that each decode on their own
+//   header (native byte order): bytes of events, number of events,
+//     step before the first event, birth number before the first event
+//   events, as varints (7 bits a byte, low first) mostly differences
+//   from what came before, so most fit in a byte or two:
+//     (step - previous step)*2, +1 for a death
+//     birth: birth number - parent's (0 if none), location, size,
+//       genotype label (genotypes are named by size and label)
+//     death: last birth number - its birth number
+
+#define PHYLOMAGIC "DEVP"
+#define PHYLOVERSION 1
+#define PHYLOHEADER 24
+// bytes of events before a block is written out
+#define PHYLOBLOCK 65536
+
+class PhyloLog {
+  private:
+    std::ofstream file;
+    long long length;
+    
+    // block being built
+    std::vector<unsigned char> block;
+    int events;
+    int blockStep;
+    uint64_t blockBirth;
+    
+    void put(uint64_t v) {
+      while (v >= 0x80) {
+        block.push_back((v & 0x7f) | 0x80);
+        v >>= 7;
+      }
+      block.push_back(v);
+    }
+    void startEvent(int step, bool death) {
+      if (events == 0) {
+        blockStep = lastStep;
+        blockBirth = lastBirth;
+      }
+      put((uint64_t)(step - lastStep)*2 + death);
+      lastStep = step;
+      events++;
+    }
+    void endBlock() {
+      if (events == 0) return;
+      int32_t head[2] = { (int32_t)block.size(), events };
+      file.write((const char*)head, 8);
+      file.write((const char*)&blockStep, 4);
+      file.write("\0\0\0\0", 4);
+      file.write((const char*)&blockBirth, 8);
+      file.write((const char*)&block[0], block.size());
+      length += PHYLOHEADER + block.size();
+      block.clear();
+      events = 0;
+    }
+  public:
+    // step of the last event and the last birth number given out
+    // (saved in snapshots)
+    int lastStep;
+    uint64_t lastBirth;
+    
+    // carry on a log start bytes long (0 for a new one)
+    PhyloLog(const std::string& name, long long start) {
+      std::ios::openmode mode = std::ios::out | std::ios::binary;
+      if (start > 0) mode |= std::ios::app;
+      file.open(name.c_str(), mode);
+      length = start;
+      if (start == 0) {
+        int32_t version = PHYLOVERSION;
+        file.write(PHYLOMAGIC, 4);
+        file.write((const char*)&version, 4);
+        length = 8;
+      }
+      events = 0;
+      lastStep = 0;
+      lastBirth = 0;
+    }
+    ~PhyloLog() {
+      endBlock();
+    }
+    bool ok() {
+      return file.good();
+    }
+    // return the new birth number
+    uint64_t birth(int step, uint64_t parent, int loc, int size, 
+                   int label) {
+      startEvent(step, false);
+      lastBirth++;
+      put(parent == 0 ? 0 : lastBirth - parent);
+      put(loc);
+      put(size);
+      put(label);
+      if (block.size() >= PHYLOBLOCK) endBlock();
+      return lastBirth;
+    }
+    void death(int step, uint64_t num) {
+      startEvent(step, true);
+      put(lastBirth - num);
+      if (block.size() >= PHYLOBLOCK) endBlock();
+    }
+    // length of the file with everything so far in it (for snapshots)
+    long long position() {
+      endBlock();
+      file.flush();
+      return length;
+    }
+};
+
+// **************************************************************** //
+// Reports
+// Everything printed goes through the Soup's Reporter as records: 
+// type (1 byte), payload length (4 bytes), payload, numbers in native
+// byte order. With OUTPUT=1 the records are the output (read back by
+// Decode.cpp with formatRecord()), otherwise they are formatted as text
+// on the way out.
+//   REC_TEXT   text as it would be printed
+//   REC_STEP   step, starts the info printed every PRINTINFOTIME
+//   REC_SIZES  number of sizes, then each size and its number of Machines
+//   REC_SOUP   memory size, number of Machines, the IP of each in queue
+//              order, memory, number of extents, then start, length and
+//              owner of each
+//   REC_BIRTH  step, ID, parent ID (0 if none), location, size
+//   REC_DEATH  step, ID, location, size
+//   REC_GENES  genotypes seen, number of live genotypes, then for each
+//              (most abundant first) size, label, live, total born
+//              (8 bytes), step first seen, parent's size and label (-1 -1 if none)
+//   REC_COUNTERS  number of counters, then for each the length of its
+//              name, the name, and its value (8 bytes), COUNTERS only
+//   REC_STATS  step, memory size, region size, occupied cells, cells
+//              changed since the last (-1 for none), entropy (8 byte
+//              double), count of each instruction and of other values,
+//              then number of regions and the occupied cells and
+//              entropy of each
+
+enum recordType {
+  REC_TEXT = 1, REC_STEP, REC_SIZES, REC_SOUP, REC_BIRTH, REC_DEATH,
+  REC_GENES, REC_COUNTERS, REC_STATS
+};
+
+// genotype name: size then label in letters, as 157aab
+void formatGenotype(int size, int label, std::ostream& out) {
+  char letters[8];
+  int i;
+  for (i=0; i < 3 || label > 0; i++) {
+    letters[i] = 'a' + label % 26;
+    label /= 26;
+  }
+  out << size;
+  while (i > 0) out << letters[--i];
+}
 
-void printMemory() {
-  node<Machine*>* current = CPUs->getHead();
+// Display memory from a REC_SOUP record
+// Shows memory protection, memory contents and Machine locations
+// return false on a bad record
+bool formatSoup(snapReader& r, std::ostream& out) {
+  int memSize = r.get32();
+  int n = r.get32();
+  if (!r.ok || memSize <= 0 || n < 0) return false;
   
-  bool CPUpresent[MEMSIZE];
+  std::vector<bool> CPUpresent(memSize, false);
   int i;
-  for (i=0; i < MEMSIZE; i++)
-    CPUpresent[i] = 0;
   
-  std::cout << "  IPs: ";
-  while (current != NULL) {
-    CPUpresent[current->val->IP] = true;
-    std::cout << current->val->IP << ",";
-    current = current->next;
+  out << "  IPs: ";
+  for (i=0; i < n && r.ok; i++) {
+    int IP = r.get32();
+    if (IP < 0 || IP >= memSize) return false;
+    CPUpresent[IP] = true;
+    out << IP << ",";
   }
-  std::cout << "\n";
+  out << "\n";
+  
+  std::vector<signed char> memory(memSize);
+  r.get(&memory[0], memSize);
+  
+  // owner of each cell from the extents
+  std::vector<ownerId> owners(memSize, NOOWNER);
+  n = r.get32();
+  for (i=0; i < n && r.ok; i++) {
+    int loc = r.get32();
+    int len = r.get32();
+    ownerId owner = r.get32();
+    if (loc < 0 || len < 0 || loc+len > memSize) return false;
+    int j;
+    for (j=loc; j < loc+len; j++)
+      owners[j] = owner;
+  }
+  if (!r.ok) return false;
   
-  for (i=0; i < MEMSIZE; i++) {
+  for (i=0; i < memSize; i++) {
       // new line
-      if (i % 5 == 0) std::cout << "\n" << std::left << std::setw(10) << i;
+      if (i % 5 == 0) out << "\n" << std::left << std::setw(10) << i;
       
       // memory protection
-      if (memProtect[i] != NULL) 
-        std::cout << std::right << std::setw(9) << memProtect[i];
+      if (owners[i] != NOOWNER) 
+        out << std::right << std::setw(9) << owners[i];
       else 
-        std::cout << "         ";
+        out << "         ";
       
       // active cpu here
-      if (CPUpresent[i]) std::cout << "->";
-      else std::cout << "  ";
+      if (CPUpresent[i]) out << "->";
+      else out << "  ";
       
       // instruction
-      if ((i > 0) && (memory[i-1] == PUSH) && (i < 1 || memory[i-2] != PUSH))
-        std::cout << std::left << std::setw(5) << (int)memory[i];
-      else {
-        switch (static_cast<instr>(memory[i])) {
-          case NOP:   std::cout << "     "; break;
-          case MAL:   std::cout << "MAL  "; break;
-          case FORK:  std::cout << "FORK "; break;
-          case COPY:  std::cout << "COPY "; break;
-          case WRITE: std::cout << "WRITE"; break;
-          case READ:  std::cout << "READ "; break;
-          case DO:    std::cout << "DO   "; break;
-          case LOOP:  std::cout << "LOOP "; break;
-          case SLTZ:  std::cout << "SLTZ "; break;
-          case SEZ:   std::cout << "SEZ  "; break;
-          case LOAD:  std::cout << "LOAD "; break;
-          case STORE: std::cout << "STORE"; break;
-          case PUSH:  std::cout << "PUSH "; break;
-          case POP:   std::cout << "POP  "; break;
-          case INC:   std::cout << "INC  "; break;
-          case DEC:   std::cout << "DEC  "; break;
-          case ALU:   std::cout << "ALU  "; break;
-          case RAND:  std::cout << "RAND "; break;
-          default: 
-            std::cout << std::left << std::setw(5) << (int)memory[i]; break;
+      if ((i > 0) && (memory[i-1] == PUSH) && (i < 2 || memory[i-2] != PUSH))
+        out << std::left << std::setw(5) << (int)memory[i];
+      else if (memory[i] == NOP)
+        out << "     ";
+      else if (memory[i] > NOP && memory[i] < NINSTR)
+        out << std::left << std::setw(5) << codeNames[(int)memory[i]];
+      else
+        out << std::left << std::setw(5) << (int)memory[i];
+      out << " ";
+  }
+  out << "\n";
+  return true;
+}
+
+// Print a record as text, births and deaths only with events
+// (Decode.o -e), return false on a bad record
+bool formatRecord(int type, snapReader& r, std::ostream& out, 
+                  bool events = false) {
+  int i, n;
+  switch (type) {
+    case REC_TEXT:
+      out.write(r.p, r.end - r.p);
+      break;
+    case REC_STEP:
+      out << "\n########################################\n";
+      out << "GLOBAL STEP " << r.get32() << "\n";
+      break;
+    case REC_SIZES:
+      out << "  CPUs of:\n";
+      n = r.get32();
+      for (i=0; i < n && r.ok; i++) {
+        int size = r.get32();
+        int num = r.get32();
+        out << "    Size " << size << ": " << num << "\n";
+      }
+      break;
+    case REC_SOUP:
+      if (!formatSoup(r, out)) return false;
+      break;
+    case REC_GENES:
+    {
+      int seen = r.get32();
+      n = r.get32();
+      out << "  Genotypes: " << n << " alive of " << seen << " seen\n";
+      for (i=0; i < n && r.ok; i++) {
+        int size = r.get32();
+        int label = r.get32();
+        out << "    ";
+        formatGenotype(size, label, out);
+        int live = r.get32();
+        long long total = r.get64();
+        out << ": " << live << " alive, " << total << " born";
+        out << ", since step " << r.get32();
+        size = r.get32();
+        label = r.get32();
+        if (size >= 0) {
+          out << ", from ";
+          formatGenotype(size, label, out);
         }
-      } 
-      std::cout << " ";
+        out << "\n";
+      }
+      break;
+    }
+    case REC_COUNTERS:
+      out << "  Counters:\n";
+      n = r.get32();
+      for (i=0; i < n && r.ok; i++) {
+        int len = r.get32();
+        if (len < 0 || len > r.end - r.p) return false;
+        out << "    ";
+        out.write(r.p, len);
+        r.p += len;
+        out << ": " << r.get64() << "\n";
+      }
+      break;
+    case REC_STATS:
+    {
+      double e;
+      out << "\nSTATS STEP " << r.get32() << "\n";
+      int size = r.get32();
+      int region = r.get32();
+      out << "  Occupied: " << r.get32() << " of " << size;
+      n = r.get32();
+      if (n >= 0) out << ", " << n << " changed";
+      r.get(&e, 8);
+      out << ", entropy " << std::fixed << std::setprecision(3) << e;
+      out << " bits\n  Instructions:";
+      for (i=0; i <= NINSTR && r.ok; i++) {
+        if (i % 6 == 0) out << "\n   ";
+        out << " " << (i < NINSTR ? codeNames[i] : "other");
+        out << " " << r.get32();
+      }
+      out << "\n  Regions of " << region << " (occupied, entropy):\n";
+      n = r.get32();
+      for (i=0; i < n && r.ok; i++) {
+        int occupied = r.get32();
+        r.get(&e, 8);
+        out << "    " << std::left << std::setw(10) << i*region;
+        out << std::right << std::setw(6) << occupied << " ";
+        out << std::setprecision(3) << e << "\n";
+      }
+      out.unsetf(std::ios::floatfield);
+      out << std::setprecision(6);
+      break;
+    }
+    case REC_BIRTH:
+      if (events) {
+        int step = r.get32();
+        uint32_t id = r.get32();
+        uint32_t parent = r.get32();
+        int loc = r.get32();
+        int size = r.get32();
+        out << "step " << step << ": birth " << id << " of " << parent;
+        out << " at " << loc << " size " << size << "\n";
+      }
+      break;
+    case REC_DEATH:
+      if (events) {
+        int step = r.get32();
+        uint32_t id = r.get32();
+        int loc = r.get32();
+        int size = r.get32();
+        out << "step " << step << ": death " << id;
+        out << " at " << loc << " size " << size << "\n";
+      }
+      break;
+    default:
+      // unknown records are skipped
+      break;
   }
-  std::cout << "\n";
+  return r.ok;
 }
 
-// **************************************************************** //
-// Display number of Machines of different lengths
+// Records are collected into a report, flush() ends the report.
+// With WRITEPOLICY 0 reports are written (and formatted) straight away,
+// otherwise they're handed to a writer thread through a HandoffQueue, so
+// the simulation only pays for copying out the records. When the queue
+// is full the simulation waits for room (1), drops the report (2), or
+// holds it back and appends the following reports to it until there is
+// room (3, up to MAXCOALESCE bytes, then it waits)
+#define REPORTQUEUE 64
+#define MAXCOALESCE (64 << 20)
 
-void printCPUInfo() {
-  // print CPUs of each length
-  int num[500];
-  int i;
-  for (i=0; i<500; i++) 
-    num[i] = 0;
+class Reporter {
+  private:
+    std::ostream& file;
+    int policy;
+    bool binary;
+    
+    // report being built, and reports coalesced while the queue was full
+    std::string* current;
+    std::string* pending;
+    
+    HandoffQueue<std::string*, REPORTQUEUE> queue;
+    std::thread writer;
+    std::atomic<bool> quit;
+    
+    // reports handed to the writer, reports written, bytes in the file
+    long long sent;
+    std::atomic<long long> done;
+    std::atomic<long long> length;
+    long long dropped;
     
-  node<Machine*>* current = CPUs->getHead();
-  while (current != NULL) {
-    num[current->val->mySize]++;
-    current = current->next;
+    void write(const std::string& report);
+    void writerLoop();
+    void send(std::string* report);
+    void sendWaiting(std::string* report);
+  public:
+    // start is the length of the file so far, c the settings of the Soup
+    // reporting (WRITEPOLICY and OUTPUT)
+    Reporter(std::ostream& f, long long start, const Config& c);
+    ~Reporter();
+    
+    void record(int type, snapBuffer& b);
+    void flush();
+    long long position();
+};
+
+Reporter::Reporter(std::ostream& f, long long start, const Config& c) : 
+    file(f) {
+  policy = c.writePolicy;
+  binary = c.output == 1;
+  current = new std::string();
+  pending = NULL;
+  quit = false;
+  sent = 0;
+  done = 0;
+  length = start;
+  dropped = 0;
+  if (policy != 0) writer = std::thread(&Reporter::writerLoop, this);
+}
+Reporter::~Reporter() {
+  flush();
+  if (writer.joinable()) {
+    if (pending != NULL) sendWaiting(pending);
+    quit = true;
+    writer.join();
   }
-  
-  std::cout << "  CPUs of:\n";
-  for (i=0; i<500; i++)
-    if (num[i] > 0) std::cout << "    Size " << i << ": " << num[i] << "\n";
+  file.flush();
+  delete current;
+  if (dropped > 0) 
+    std::cerr << dropped << " reports dropped, the writer fell behind\n";
 }
 
-// **************************************************************** //
-// Print array contents
+void Reporter::record(int type, snapBuffer& b) {
+  int32_t len = b.data.size();
+  current->push_back(type);
+  current->append((const char*)&len, 4);
+  if (len > 0) current->append(&b.data[0], len);
+}
 
-void printArray(short int array[], int len) {
-  int i;
-  for (i=0; i < len; i++)
-    std::cout << array[i] << ",";
-  std::cout << "\n";
+// end the report being built
+void Reporter::flush() {
+  if (current->empty()) return;
+  if (policy == 0) {
+    write(*current);
+    current->clear();
+    return;
+  }
+  send(current);
+  current = new std::string();
 }
 
-// **************************************************************** //
-//                Setup memory and run simulation
-// **************************************************************** //
+// Length of the file once everything reported so far is in it,
+// waits for the writer to get there
+long long Reporter::position() {
+  flush();
+  if (policy == 0) {
+    file.flush();
+    return length;
+  }
+  if (pending != NULL) {
+    sendWaiting(pending);
+    pending = NULL;
+  }
+  while (done != sent) std::this_thread::yield();
+  return length;
+}
 
-int main() {
-  //redirect std::cout to out.txt
-  std::ofstream out("out.txt");
-  std::cout.rdbuf(out.rdbuf());
-  
-  int i;
-  for (i=0; i < MEMSIZE; i++) 
-    memProtect[i] = NULL;
-
-  // print general information
-  std::cout << "Settings:\n";
-  std::cout << "  Memory size     : " << MEMSIZE << "\n";
-  std::cout << "  Simulation steps: " << SIMSTEPS << "\n";
-  std::cout << "  Print intervals : " << PRINTINFOTIME << "\n";
-  std::cout << "  Min free % mem  : " << MINFREEMEM << "\n";
-  std::cout << "\n";
-  std::cout << "  Max programs    : " << MAXALIVE << "\n";
-  std::cout << "  Program size    : " << MINSIZE << "-" << MAXSIZE << "\n";
-  std::cout << "  Iterations/step : " << STEPSPERCYCLE << "\n";
-  std::cout << "  Iter lost/error : " << ERRORSTEPS << "\n";
-  std::cout << "  Loopstack size  : " << LOOPSTACKSIZE << "\n";
-  std::cout << "  Datastack size  : " << DATASTACKSIZE << "\n";
-  std::cout << "  Number registers: " << NREGS << "\n";
-  std::cout << "\n";
-  std::cout << "  Copy fault chance     : 1/" << MUTCHANCE << "\n";
-  std::cout << "  Execution fault chance: 1/" << ERRORCHANCE << "\n";
-  std::cout << "\n";
-  // seed RNG
+void Reporter::send(std::string* report) {
+  if (pending != NULL) {
+    // stays behind the reports already held back
+    pending->append(*report);
+    delete report;
+    report = pending;
+    pending = NULL;
+  }
+  if (queue.push(report)) {
+    sent++;
+  } else if (policy == 2) {
+    dropped++;
+    delete report;
+  } else if (policy == 3 && report->size() < MAXCOALESCE) {
+    pending = report;
+  } else {
+    sendWaiting(report);
+  }
+}
+void Reporter::sendWaiting(std::string* report) {
+  while (!queue.push(report)) std::this_thread::yield();
+  sent++;
+}
+
+// write out a report, as it is or as text
+void Reporter::write(const std::string& report) {
+  if (binary) {
+    file.write(report.data(), report.size());
+    length += report.size();
+    return;
+  }
+  std::ostringstream text;
+  snapReader r = { report.data(), report.data() + report.size(), true };
+  while (r.p < r.end) {
+    int type = (unsigned char)*r.p++;
+    int32_t len = r.get32();
+    snapReader payload = { r.p, r.p + len, true };
+    formatRecord(type, payload, text);
+    r.p += len;
+  }
+  std::string s = text.str();
+  file.write(s.data(), s.size());
+  length += s.size();
+}
+
+void Reporter::writerLoop() {
+  std::string* report;
+  for (;;) {
+    // everything sent before quit is in the queue once quit is seen
+    bool last = quit;
+    if (queue.pop(report)) {
+      write(*report);
+      delete report;
+      file.flush();
+      done++;
+    } else if (last) {
+      return;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+// Hash of the len cells from loc (wrapping round) and len
+uint64_t Soup::genomeHash(int loc, int len) {
+  uint64_t h = len;
+  int i;
+  for (i=0; i < len; i++)
+    h = (h ^ (unsigned char)memory[mapToRange(loc+i, memSize)]) * 
+        1099511628211ULL;
+  return h ^ (h >> 32);
+}
+
+// note a new Machine in the genebank, the phylogeny log and the binary
+// output
+void Soup::recordBirth(Machine* m, Machine* parent) {
+  COUNT(births);
+  lastBirth = step;
+  m->genotypeNum = genes.birth(genomeHash(m->location, m->mySize), 
+                               m->mySize, 
+                               parent == NULL ? -1 : parent->genotypeNum,
+                               step);
+  m->birthNum = 0;
+  if (phylo != NULL)
+    m->birthNum = phylo->birth(step, parent == NULL ? 0 : parent->birthNum,
+                               m->location, m->mySize, 
+                               genes[m->genotypeNum].label);
+  if (cfg.output != 1) return;
+  snapBuffer b;
+  b.put32(step);
+  b.put32(m->id);
+  b.put32(parent == NULL ? NOOWNER : parent->id);
+  b.put32(m->location);
+  b.put32(m->mySize);
+  out.record(REC_BIRTH, b);
+}
+void Soup::recordDeath(Machine* m) {
+  COUNT(deaths);
+  genes.death(m->genotypeNum);
+  if (phylo != NULL) phylo->death(step, m->birthNum);
+  if (cfg.output != 1) return;
+  snapBuffer b;
+  b.put32(step);
+  b.put32(m->id);
+  b.put32(m->location);
+  b.put32(m->mySize);
+  out.record(REC_DEATH, b);
+}
+
+// **************************************************************** //
+// Report memory: memory protection, memory contents and Machine locations
+
+void Soup::printMemory() {
+  snapBuffer b;
+  std::vector<int> IPs;
+  unsigned p;
+  for (p = CPUs->first(); p != CPUs->end(); p++)
+    IPs.push_back((*CPUs)[p]->IP);
+  b.put32(memSize);
+  b.put32(IPs.size());
+  b.put(IPs);
+  b.put(memory, memSize);
+  std::vector<int> extents;
+  memProtect->list(extents);
+  b.put32(extents.size() / 3);
+  b.put(extents);
+  out.record(REC_SOUP, b);
+}
+
+// **************************************************************** //
+// Report number of Machines of different lengths
+
+void Soup::printCPUInfo() {
+  // CPUs of each length, up to the largest alive (a Machine restored
+  // from a run with a larger MAXSIZE can be over this run's)
+  int largest = cfg.maxSize;
+  unsigned p;
+  for (p = CPUs->first(); p != CPUs->end(); p++)
+    largest = std::max(largest, (*CPUs)[p]->mySize);
+  std::vector<int> num(largest+1, 0);
+  int i;
+    
+  for (p = CPUs->first(); p != CPUs->end(); p++)
+    num[(*CPUs)[p]->mySize]++;
+  
+  std::vector<int> sizes;
+  for (i=0; i < (int)num.size(); i++)
+    if (num[i] > 0) {
+      sizes.push_back(i);
+      sizes.push_back(num[i]);
+    }
+  snapBuffer b;
+  b.put32(sizes.size() / 2);
+  b.put(sizes);
+  out.record(REC_SIZES, b);
+}
+
+// **************************************************************** //
+// Snapshots
+// File layout (native byte order):
+//   header, SNAPHEADER bytes: magic, version, memory size, next step,
+//     length of out so far, world RNG, number of registers, data and
+//     loop stack sizes, whether code holds superinstructions, length
+//     of the phylogeny log so far (0 for none)
+//   memory, then code (memSize bytes each, so both can be mapped)
+//   extents: count, then start, length and owner of each
+//   pool: slots, number free, free slot stack, then each slot's Machine
+//   queue: length, then the slot of each Machine from front to rear
+//   genebank: genotypes seen of each size (count, then each), 
+//     genotypes seen, Machines born, count of slots, then each genotype
+//     (size 0 for a free slot)
+//   phylogeny log: last step and last birth number
+//   step of the last birth
+//   statistics: length (0 or memory size), memory at the last report
+
+#define SNAPMAGIC "DEVS"
+#define SNAPVERSION 6
+#define SNAPHEADER 64
+#ifdef FUSION
+#define SNAPFUSION 1
+#else
+#define SNAPFUSION 0
+#endif
+
+void putMachine(snapBuffer& b, Machine* m, int nRegs) {
+  int i;
+  b.put32(m->id);
+  b.put32(m->location);
+  b.put32(m->IP);
+  for (i=0; i < nRegs; i++)
+    b.put32(m->reg[i]);
+  // stacks bottom first
+  b.put32(m->dataStack.size());
+  for (i=m->dataStack.size()-1; i >= 0; i--)
+    b.put32(m->dataStack.peek(i));
+  b.put32(m->loopStack.size());
+  for (i=m->loopStack.size()-1; i >= 0; i--)
+    b.put32(m->loopStack.peek(i));
+  b.put32(m->mySize);
+  b.put32(m->childLoc);
+  b.put32(m->childSize);
+  b.put64(m->rng.getState());
+  b.put32(m->errorIn);
+  b.put32(m->mutateIn);
+  b.put32(m->genotypeNum);
+  b.put64(m->birthNum);
+}
+void getMachine(snapReader& r, Machine* m, int nRegs) {
+  int i, n;
+  m->id = r.get32();
+  m->location = r.get32();
+  m->IP = r.get32();
+  for (i=0; i < nRegs; i++)
+    m->reg[i] = r.get32();
+  m->dataStack.resetStack();
+  n = r.get32();
+  for (i=0; i < n; i++)
+    if (!m->dataStack.push(r.get32())) r.ok = false;
+  m->loopStack.resetStack();
+  n = r.get32();
+  for (i=0; i < n; i++)
+    if (!m->loopStack.push(r.get32())) r.ok = false;
+  m->mySize = r.get32();
+  m->childLoc = r.get32();
+  m->childSize = r.get32();
+  m->rng.setState(r.get64());
+  m->errorIn = r.get32();
+  m->mutateIn = r.get32();
+  m->genotypeNum = r.get32();
+  m->birthNum = r.get64();
+}
+
+// Write a snapshot to file, through a temporary file so a crash part way
+// leaves the previous snapshot intact
+void writeSnapshot(std::string file, std::vector<char> data) {
+  std::string temp = file + ".tmp";
   {
-    int seed = time(NULL);
-    std::cout << "  Seed: " << seed << "\n";
-    srand(seed);
+    std::ofstream f(temp.c_str(), std::ios::binary | std::ios::trunc);
+    f.write(&data[0], data.size());
+    if (!f) {
+      std::cerr << "Could not write " << temp << "\n";
+      return;
+    }
+  }
+  if (rename(temp.c_str(), file.c_str()) != 0)
+    std::cerr << "Could not replace " << file << "\n";
+}
+
+// Everything the rest of the run depends on, as a snapshot
+void Soup::snapshot(snapBuffer& b) {
+  b.data.reserve(SNAPHEADER + 2*(size_t)memSize);
+  
+  b.put(SNAPMAGIC, 4);
+  b.put32(SNAPVERSION);
+  b.put32(memSize);
+  b.put32(step);
+  b.put64(out.position());
+  b.put64(rng.getState());
+  b.put32(cfg.nRegs);
+  b.put32(cfg.dataStackSize);
+  b.put32(cfg.loopStackSize);
+  b.put32(SNAPFUSION);
+  b.put64(phylo == NULL ? 0 : phylo->position());
+  b.data.resize(SNAPHEADER, 0);
+  
+  b.put(memory, memSize);
+  b.put(code, memSize);
+  
+  std::vector<int> extents;
+  memProtect->list(extents);
+  b.put32(extents.size() / 3);
+  int i;
+  for (i=0; i < (int)extents.size(); i++)
+    b.put32(extents[i]);
+  
+  b.put32(machines->slots());
+  b.put32(machines->numFreeSlots());
+  for (i=0; i < machines->numFreeSlots(); i++)
+    b.put32(machines->freeSlot(i));
+  for (i=0; i < machines->slots(); i++)
+    putMachine(b, (*machines)[i], cfg.nRegs);
+  
+  std::vector<int> order;
+  unsigned p;
+  for (p = CPUs->first(); p != CPUs->end(); p++)
+    order.push_back(((*CPUs)[p]->id & SLOTMASK) - 1);
+  b.put32(order.size());
+  for (i=0; i < (int)order.size(); i++)
+    b.put32(order[i]);
+  
+  b.put32(genes.labels().size());
+  b.put(genes.labels());
+  b.put64(genes.seen());
+  b.put64(genes.born());
+  b.put32(genes.size());
+  for (i=0; i < genes.size(); i++) {
+    genotype& g = genes[i];
+    b.put64(g.hash);
+    b.put32(g.size);
+    b.put32(g.label);
+    b.put32(g.live);
+    b.put64(g.total);
+    b.put32(g.firstStep);
+    b.put32(g.parent);
+  }
+  
+  b.put32(phylo == NULL ? 0 : phylo->lastStep);
+  b.put64(phylo == NULL ? 0 : phylo->lastBirth);
+  b.put32(lastBirth);
+  b.put32(lastStats.size());
+  if (!lastStats.empty()) b.put(&lastStats[0], lastStats.size());
+}
+
+// Save a snapshot, the file itself is written by a background thread
+// from a copy so the run carries on
+void Soup::checkpoint() {
+  snapBuffer b;
+  snapshot(b);
+  // one snapshot written at a time
+  if (snapWriter.joinable()) snapWriter.join();
+  snapWriter = std::thread(writeSnapshot, snapName, std::move(b.data));
+}
+
+// Memory size, and length of out and of the phylogeny log when a snapshot
+// was taken, false if file isn't a snapshot this build can read
+bool snapshotInfo(const char* file, int& size, long long& outPos, 
+                  long long& phyloPos) {
+  std::ifstream f(file, std::ios::binary);
+  char header[SNAPHEADER];
+  if (!f.read(header, SNAPHEADER)) return false;
+  snapReader r = { header, header + SNAPHEADER, true };
+  char magic[4];
+  r.get(magic, 4);
+  if (memcmp(magic, SNAPMAGIC, 4) != 0 || r.get32() != SNAPVERSION)
+    return false;
+  size = r.get32();
+  r.get32();
+  outPos = r.get64();
+  r.get64();
+  r.get32();
+  r.get32();
+  r.get32();
+  r.get32();
+  phyloPos = r.get64();
+  return size >= 2*cfg.maxSize;
+}
+
+// Continue from a snapshot (as written by checkpoint() or fork()) in the
+// open file fd into this new Soup (of the same memory size). Memory and
+// code are mapped straight from the file, pages are only read in (and
+// copied) as they are used.
+// Return false if the snapshot can't be used
+bool Soup::restore(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < SNAPHEADER + 2*(long long)memSize)
+    return false;
+  size_t len = st.st_size;
+  void* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) return false;
+  
+  snapReader r = { (const char*)base, (const char*)base + len, true };
+  char magic[4];
+  r.get(magic, 4);
+  if (memcmp(magic, SNAPMAGIC, 4) != 0 || r.get32() != SNAPVERSION || 
+      r.get32() != memSize) {
+    munmap(base, len);
+    return false;
+  }
+  int next = r.get32();
+  r.get64();
+  uint64_t rngState = r.get64();
+  if (r.get32() != cfg.nRegs || r.get32() != cfg.dataStackSize || 
+      r.get32() != cfg.loopStackSize) {
+    munmap(base, len);
+    return false;
+  }
+  bool sameCode = r.get32() == SNAPFUSION;
+  
+  munmap(mapBase, mapLen);
+  mapBase = (char*)base;
+  mapLen = len;
+  memory = (signed char*)(mapBase + SNAPHEADER);
+  code = (unsigned char*)(mapBase + SNAPHEADER + memSize);
+  // written by a build that decodes differently
+  if (!sameCode) memDecode(0, memSize);
+  r.p = mapBase + SNAPHEADER + 2*memSize;
+  
+  int i, n;
+  n = r.get32();
+  for (i=0; i < n && r.ok; i++) {
+    int loc = r.get32();
+    int len = r.get32();
+    ownerId owner = r.get32();
+    if (loc < 0 || len <= 0 || loc+len > memSize || 
+        !memProtect->isFree(loc, len)) return false;
+    memProtect->insert(loc, len, owner);
+  }
+  
+  int slots = r.get32();
+  std::vector<int> freeList;
+  n = r.get32();
+  for (i=0; i < n && r.ok; i++)
+    freeList.push_back(r.get32());
+  if (!r.ok || !machines->restore(slots, freeList)) return false;
+  for (i=0; i < slots; i++)
+    getMachine(r, (*machines)[i], cfg.nRegs);
+  
+  n = r.get32();
+  for (i=0; i < n && r.ok; i++) {
+    int slot = r.get32();
+    if (slot < 0 || slot >= slots) return false;
+    CPUs->enqueue((*machines)[slot]);
+  }
+  
+  n = r.get32();
+  if (n < 0 || n > (long long)len) return false;
+  std::vector<int> labels(n);
+  for (i=0; i < n && r.ok; i++)
+    labels[i] = r.get32();
+  long long seen = r.get64();
+  long long born = r.get64();
+  n = r.get32();
+  if (n < 0 || n > (long long)len) return false;
+  std::vector<genotype> saved(n);
+  for (i=0; i < n && r.ok; i++) {
+    genotype& g = saved[i];
+    g.hash = r.get64();
+    g.size = r.get32();
+    g.label = r.get32();
+    g.live = r.get32();
+    g.total = r.get64();
+    g.firstStep = r.get32();
+    g.parent = r.get32();
+    if (g.size < 0 || g.parent < -1 || g.parent >= n) return false;
+  }
+  int lastStep = r.get32();
+  uint64_t lastNum = r.get64();
+  lastBirth = r.get32();
+  n = r.get32();
+  if (n != 0 && n != memSize) return false;
+  lastStats.resize(n);
+  if (n > 0) r.get(&lastStats[0], n);
+  if (!r.ok) return false;
+  genes.restore(saved, labels, seen, born);
+  if (phylo != NULL) {
+    phylo->lastStep = lastStep;
+    phylo->lastBirth = lastNum;
+  }
+  
+  rng.setState(rngState);
+  step = next;
+  return true;
+}
+bool Soup::restore(const char* file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return false;
+  bool ok = restore(fd);
+  close(fd);
+  return ok;
+}
+
+// **************************************************************** //
+// Branching
+// fork() writes a snapshot of the Soup to an unlinked temporary file and
+// returns the file (-1 if it can't). Any number of new Soups of the same
+// memory size, registers and stack sizes can restore() from it, on any
+// threads, and carry on with settings of their own. Each maps memory
+// and code from the file copy on write, so the branches share every
+// page none of them has written, only owners, Machines and genotypes
+// are copied for each. The file goes when it is closed and the last
+// branch is gone.
+
+int Soup::fork() {
+  snapBuffer b;
+  snapshot(b);
+  FILE* f = tmpfile();
+  if (f == NULL) return -1;
+  int fd = -1;
+  if (fwrite(&b.data[0], 1, b.data.size(), f) == b.data.size() && 
+      fflush(f) == 0)
+    fd = dup(fileno(f));
+  fclose(f);
+  return fd;
+}
+
+// New random numbers for the world and every Machine from seed, and
+// fault countdowns from this Soup's chances, so a branch goes its own way
+void Soup::reseed(uint64_t seed) {
+  rng.seed(~seed);
+  unsigned p;
+  for (p = CPUs->first(); p != CPUs->end(); p++)
+    (*CPUs)[p]->seed(rng.next64(), cfg);
+}
+
+// **************************************************************** //
+// State trace (TRACE=1 records, TRACE=2 checks)
+// Every TRACETIME steps, before the step runs, a record of the whole
+// state goes to trace.bin (trace0.bin... for islands), or is checked
+// against the record there, so any change to how the soup is run can be
+// checked against a run known to be right. The first difference ends
+// the run (islands carry on), saying where it is.
+// File: magic, version, memory size, TRACETIME, TRACEBLOCK, then records:
+//   step, number of extents, hash of the extents, number of Machines,
+//   hash of the Machines in queue order, then for each TRACEBLOCK cells
+//   of memory the sum of the cells and the sum of each cell times its
+//   place in the block (1 up), so a single changed cell can be found
+// (native byte order, records are all the same length)
+
+#define TRACEMAGIC "DEVT"
+#define TRACEVERSION 1
+#define TRACEHEADER 20
+#define TRACEBLOCK 256
+
+uint64_t hashInts(uint64_t h, const int* v, int n) {
+  int i;
+  for (i=0; i < n; i++)
+    h = (h ^ (uint32_t)v[i]) * 1099511628211ULL;
+  return h;
+}
+
+// The trace record of this Soup's state now
+void Soup::traceRecord(snapBuffer& b) {
+  int i, j;
+  b.put32(step);
+  
+  std::vector<int> extents;
+  memProtect->list(extents);
+  b.put32(extents.size() / 3);
+  b.put64(extents.empty() ? 0 : hashInts(0, &extents[0], extents.size()));
+  
+  // everything that decides what a Machine does next
+  int count = 0;
+  uint64_t h = 0;
+  std::vector<int> v;
+  unsigned p;
+  for (p = CPUs->first(); p != CPUs->end(); p++) {
+    Machine* m = (*CPUs)[p];
+    v.clear();
+    v.push_back(m->id);
+    v.push_back(m->location);
+    v.push_back(m->IP);
+    for (i=0; i < cfg.nRegs; i++)
+      v.push_back(m->reg[i]);
+    v.push_back(m->dataStack.size());
+    for (i=0; i < m->dataStack.size(); i++)
+      v.push_back(m->dataStack.peek(i));
+    v.push_back(m->loopStack.size());
+    for (i=0; i < m->loopStack.size(); i++)
+      v.push_back(m->loopStack.peek(i));
+    v.push_back(m->mySize);
+    v.push_back(m->childLoc);
+    v.push_back(m->childSize);
+    uint64_t state = m->rng.getState();
+    v.push_back(state);
+    v.push_back(state >> 32);
+    v.push_back(m->errorIn);
+    v.push_back(m->mutateIn);
+    h = hashInts(h, &v[0], v.size());
+    count++;
   }
+  b.put32(count);
+  b.put64(h);
   
-  // add primeval
-  initialise();
+  for (i=0; i < memSize; i += TRACEBLOCK) {
+    uint32_t sum = 0, weighted = 0;
+    for (j=0; j < TRACEBLOCK && i+j < memSize; j++) {
+      sum += (unsigned char)memory[i+j];
+      weighted += (uint32_t)(j+1) * (unsigned char)memory[i+j];
+    }
+    b.put32(sum);
+    b.put32(weighted);
+  }
+}
+
+// trace.bin being written or checked
+class StateTrace {
+  private:
+    std::fstream file;
+    bool checking;
+    bool ended;
+    int memSize;
+    int traceTime;
+    long long recordSize;
+  public:
+    // false once the run differs from the trace
+    bool matching;
+    
+    // open name, for a run of a Soup of size cells with settings c
+    // (TRACE and TRACETIME) starting at step start (a resumed run starts
+    // after the records before start)
+    StateTrace(const std::string& name, const Config& c, int size, 
+               int start) {
+      checking = c.trace == 2;
+      memSize = size;
+      traceTime = c.traceTime;
+      recordSize = 28 + 8*((memSize + TRACEBLOCK-1) / TRACEBLOCK);
+      matching = true;
+      ended = false;
+      long long records = (start + traceTime-1) / traceTime;
+      long long pos = TRACEHEADER + records*recordSize;
+      int32_t head[3] = { memSize, traceTime, TRACEBLOCK };
+      if (checking) {
+        file.open(name.c_str(), std::ios::in | std::ios::binary);
+        char magic[4];
+        int32_t version, h[3];
+        if (!file.read(magic, 4) || !file.read((char*)&version, 4) ||
+            !file.read((char*)h, 12) || memcmp(magic, TRACEMAGIC, 4) != 0 ||
+            version != TRACEVERSION || memcmp(h, head, 12) != 0) {
+          file.close();
+          return;
+        }
+        file.seekg(pos);
+      } else if (start > 0) {
+        if (truncate(name.c_str(), pos) != 0) return;
+        file.open(name.c_str(), std::ios::out | std::ios::binary | 
+                                std::ios::app);
+      } else {
+        int32_t version = TRACEVERSION;
+        file.open(name.c_str(), std::ios::out | std::ios::binary);
+        file.write(TRACEMAGIC, 4);
+        file.write((const char*)&version, 4);
+        file.write((const char*)head, 12);
+      }
+    }
+    bool ok() {
+      return file.is_open() && file.good();
+    }
+    // write the record, or check it and say where it first differs
+    void trace(snapBuffer& b) {
+      if (!checking) {
+        file.write(&b.data[0], b.data.size());
+        return;
+      }
+      if (!matching || ended) return;
+      snapReader mine = { &b.data[0], &b.data[0] + b.data.size(), true };
+      int step = mine.get32();
+      std::vector<char> ref(recordSize);
+      if (!file.read(&ref[0], recordSize)) {
+        std::cerr << "Trace ends before step " << step << "\n";
+        ended = true;
+        return;
+      }
+      snapReader theirs = { &ref[0], &ref[0] + recordSize, true };
+      std::ostringstream where;
+      if (theirs.get32() != step) {
+        where << "trace is of another run";
+      } else if (mine.get32() != theirs.get32() || 
+                 mine.get64() != theirs.get64()) {
+        where << "memory ownership";
+      } else if (mine.get32() != theirs.get32() || 
+                 mine.get64() != theirs.get64()) {
+        where << "Machines";
+      } else {
+        int i;
+        for (i=0; i < memSize && where.str().empty(); i += TRACEBLOCK) {
+          int32_t sum = mine.get32() - theirs.get32();
+          int32_t weighted = mine.get32() - theirs.get32();
+          if (sum == 0 && weighted == 0) continue;
+          // one cell changed by sum is at weighted/sum in the block
+          int end = i + TRACEBLOCK < memSize ? i + TRACEBLOCK : memSize;
+          if (sum != 0 && weighted % sum == 0 && weighted / sum >= 1 &&
+              i + weighted / sum <= end)
+            where << "memory cell " << i + weighted / sum - 1;
+          else
+            where << "memory cells " << i << "-" << end-1;
+        }
+      }
+      if (where.str().empty()) return;
+      std::cerr << "Differs from the trace at step " << step << ": ";
+      std::cerr << where.str() << "\n";
+      matching = false;
+    }
+};
+
+// **************************************************************** //
+// Report live genotypes, most abundant first
+
+bool moreAlive(const genotype* a, const genotype* b) {
+  return a->live > b->live;
+}
+void Soup::printGenotypes() {
+  std::vector<genotype*> live;
+  int i;
+  for (i=0; i < genes.size(); i++)
+    if (genes[i].live > 0) live.push_back(&genes[i]);
+  std::stable_sort(live.begin(), live.end(), moreAlive);
   
+  snapBuffer b;
+  b.put32(genes.seen());
+  b.put32(live.size());
+  for (i=0; i < (int)live.size(); i++) {
+    genotype* g = live[i];
+    b.put32(g->size);
+    b.put32(g->label);
+    b.put32(g->live);
+    b.put64(g->total);
+    b.put32(g->firstStep);
+    b.put32(g->parent < 0 ? -1 : genes[g->parent].size);
+    b.put32(g->parent < 0 ? -1 : genes[g->parent].label);
+  }
+  out.record(REC_GENES, b);
+}
+
+// **************************************************************** //
+// Statistics of memory
+// Whole-memory scans, cheap enough to run every few thousand steps.
+// The scans have SSE2 and AVX2 kernels, the AVX2 ones chosen at run
+// time on processors that have it (GCC and Clang on x86), and plain
+// loops elsewhere. Cells that differ from the last report are counted a
+// vector at a time. Cells holding an instruction are counted with one
+// compare and subtract per instruction per vector into byte counters;
+// the rare cells holding anything else are found by a mask and counted
+// one by one. The histogram of each region is summed into the whole
+// soup's, which isn't scanned again. Occupied cells come from the
+// extents, not memory.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISPATCHAVX2
+#endif
+
+// number of cells that differ between a and b
+int countDiffsPlain(const signed char* a, const signed char* b, int n) {
+  int diffs = 0;
+  int i = 0;
+#if defined(__SSE2__)
+  for (; i+16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b+i));
+    unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    diffs += 16 - __builtin_popcount(same);
+  }
+#endif
+  for (; i < n; i++)
+    diffs += a[i] != b[i];
+  return diffs;
+}
+// Histograms count the instructions OPSPASS at a time, so their byte
+// counters stay in registers, over at most 255 vectors so none overflows
+#define OPSPASS 9
+static_assert(NINSTR % OPSPASS == 0, "instructions must split evenly");
+
+#if defined(__SSE2__)
+// adds to counts[k] for k in [from, from+OPSPASS) the cells of value k
+// in [c, c+n), n a multiple of 16 up to 255*16
+void countOpsSSE2(const unsigned char* c, int n, int from, 
+                  int counts[256]) {
+  __m128i acc[OPSPASS];
+  int i, k;
+  for (k=0; k < OPSPASS; k++)
+    acc[k] = _mm_setzero_si128();
+  for (i=0; i < n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(c+i));
+#pragma GCC unroll 9
+    for (k=0; k < OPSPASS; k++)
+      acc[k] = _mm_sub_epi8(acc[k], _mm_cmpeq_epi8(x, _mm_set1_epi8(from+k)));
+  }
+  for (k=0; k < OPSPASS; k++) {
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)sums, 
+                     _mm_sad_epu8(acc[k], _mm_setzero_si128()));
+    counts[from+k] += sums[0] + sums[1];
+  }
+}
+#endif
+// adds to counts[v] the cells of value v (as unsigned char) in [p, p+n)
+void histogramPlain(const signed char* p, int n, int counts[256]) {
+  const unsigned char* c = (const unsigned char*)p;
+  int i = 0;
+#if defined(__SSE2__)
+  __m128i top = _mm_set1_epi8(NINSTR-1);
+  while (i+16 <= n) {
+    int len = std::min((n - i) & ~15, 255*16);
+    int from;
+    for (from=0; from < NINSTR; from += OPSPASS)
+      countOpsSSE2(c+i, len, from, counts);
+    // cells that aren't instructions
+    for (; len > 0; len -= 16, i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(c+i));
+      __m128i instr = _mm_cmpeq_epi8(_mm_min_epu8(x, top), x);
+      unsigned rest = ~_mm_movemask_epi8(instr) & 0xffff;
+      while (rest != 0) {
+        counts[c[i + __builtin_ctz(rest)]]++;
+        rest &= rest - 1;
+      }
+    }
+  }
+#endif
+  for (; i < n; i++)
+    counts[c[i]]++;
+}
+
+#ifdef DISPATCHAVX2
+__attribute__((target("avx2")))
+int countDiffsAVX2(const signed char* a, const signed char* b, int n) {
+  int diffs = 0;
+  int i = 0;
+  for (; i+32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b+i));
+    unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    diffs += 32 - __builtin_popcount(same);
+  }
+  for (; i < n; i++)
+    diffs += a[i] != b[i];
+  return diffs;
+}
+__attribute__((target("avx2")))
+void countOpsAVX2(const unsigned char* c, int n, int from, 
+                  int counts[256]) {
+  __m256i acc[OPSPASS];
+  int i, k;
+  for (k=0; k < OPSPASS; k++)
+    acc[k] = _mm256_setzero_si256();
+  for (i=0; i < n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(c+i));
+#pragma GCC unroll 9
+    for (k=0; k < OPSPASS; k++)
+      acc[k] = _mm256_sub_epi8(acc[k], 
+                               _mm256_cmpeq_epi8(x, _mm256_set1_epi8(from+k)));
+  }
+  for (k=0; k < OPSPASS; k++) {
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i*)sums, 
+                        _mm256_sad_epu8(acc[k], _mm256_setzero_si256()));
+    counts[from+k] += sums[0] + sums[1] + sums[2] + sums[3];
+  }
+}
+__attribute__((target("avx2")))
+void histogramAVX2(const signed char* p, int n, int counts[256]) {
+  const unsigned char* c = (const unsigned char*)p;
+  int i = 0;
+  __m256i top = _mm256_set1_epi8(NINSTR-1);
+  while (i+32 <= n) {
+    int len = std::min((n - i) & ~31, 255*32);
+    int from;
+    for (from=0; from < NINSTR; from += OPSPASS)
+      countOpsAVX2(c+i, len, from, counts);
+    for (; len > 0; len -= 32, i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(c+i));
+      __m256i instr = _mm256_cmpeq_epi8(_mm256_min_epu8(x, top), x);
+      unsigned rest = ~_mm256_movemask_epi8(instr);
+      while (rest != 0) {
+        counts[c[i + __builtin_ctz(rest)]]++;
+        rest &= rest - 1;
+      }
+    }
+  }
+  for (; i < n; i++)
+    counts[c[i]]++;
+}
+bool hasAVX2() {
+  static bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+#endif
+
+int countDiffs(const signed char* a, const signed char* b, int n) {
+#ifdef DISPATCHAVX2
+  if (hasAVX2()) return countDiffsAVX2(a, b, n);
+#endif
+  return countDiffsPlain(a, b, n);
+}
+void histogram(const signed char* p, int n, int counts[256]) {
+#ifdef DISPATCHAVX2
+  if (hasAVX2()) {
+    histogramAVX2(p, n, counts);
+    return;
+  }
+#endif
+  histogramPlain(p, n, counts);
+}
+// Shannon entropy in bits per cell of n cells with these counts,
+// with total the counts are added to it and counts left zero
+double entropy(int counts[256], int n, int* total = NULL) {
+  double e = 0;
+  int i;
+  for (i=0; i < 256; i++) {
+    if (counts[i] == 0) continue;
+    double p = (double)counts[i] / n;
+    e -= p * log2(p);
+    if (total != NULL) {
+      total[i] += counts[i];
+      counts[i] = 0;
+    }
+  }
+  return e;
+}
+
+void Soup::printStats() {
+  int numRegions = (memSize + STATSREGION-1) / STATSREGION;
+  std::vector<int> occupied(numRegions, 0);
+  std::vector<int> extents;
+  memProtect->list(extents);
+  int i;
+  for (i=0; i < (int)extents.size(); i += 3) {
+    int loc = extents[i], end = extents[i] + extents[i+1];
+    while (loc < end) {
+      int k = loc / STATSREGION;
+      int next = std::min(end, (k+1) * STATSREGION);
+      occupied[k] += next - loc;
+      loc = next;
+    }
+  }
+  
+  snapBuffer b;
+  b.put32(step);
+  b.put32(memSize);
+  b.put32(STATSREGION);
+  b.put32(memSize - memAvailable());
+  if (lastStats.empty()) {
+    b.put32(-1);
+    lastStats.resize(memSize);
+  } else {
+    b.put32(countDiffs(&lastStats[0], memory, memSize));
+  }
+  memcpy(&lastStats[0], memory, memSize);
+  
+  // each region, then the whole soup from the sum of their counts
+  int counts[256], total[256];
+  memset(counts, 0, sizeof(counts));
+  memset(total, 0, sizeof(total));
+  snapBuffer regions;
+  regions.put32(numRegions);
+  for (i=0; i < numRegions; i++) {
+    int loc = i * STATSREGION;
+    int n = std::min(STATSREGION, memSize - loc);
+    histogram(memory + loc, n, counts);
+    double e = entropy(counts, n, total);
+    regions.put32(occupied[i]);
+    regions.put(&e, 8);
+  }
+  double e = entropy(total, memSize);
+  b.put(&e, 8);
+  int other = memSize;
+  for (i=0; i < NINSTR; i++) {
+    b.put32(total[i]);
+    other -= total[i];
+  }
+  b.put32(other);
+  b.put(regions.data.data(), regions.data.size());
+  out.record(REC_STATS, b);
+}
+
+// **************************************************************** //
+// Report the counters of this Soup and its helper threads since the
+// start of the run (with THREADS > 1 they include speculative runs that
+// were thrown away), times in microseconds, zero counts left out
+
+void Soup::printCounters() {
+  counters c = counts;
+  int i;
+  if (sched != NULL)
+    for (i=1; i < sched->threads(); i++)
+      c.add(sched->helperCounts[i]);
+  
+  const char* faultNames[4] = {
+    NULL, "stack underflows", "stack overflows", "execution errors"
+  };
+  std::vector<std::string> names;
+  std::vector<uint64_t> values;
+  for (i=0; i < NCODES; i++) {
+    names.push_back(codeNames[i]);
+    values.push_back(c.ops[i]);
+  }
+  for (i=1; i < 4; i++) {
+    names.push_back(faultNames[i]);
+    values.push_back(c.faults[i]);
+  }
+  const char* otherNames[] = {
+    "random instructions", "random writes", "steps lost to errors",
+    "MAL ok", "MAL failed", "births", "deaths", "reaped",
+    "us reporting", "us executing", "us reaping", "us migrating",
+    "us saving"
+  };
+  uint64_t others[] = {
+    c.execFaults, c.copyFaults, c.errorSteps, c.malOk, c.malFailed,
+    c.births, c.deaths, c.reaped, c.timeReport / 1000,
+    c.timeExecute / 1000, c.timeReaper / 1000, c.timeMigrate / 1000,
+    c.timeSave / 1000
+  };
+  for (i=0; i < (int)(sizeof(others) / sizeof(others[0])); i++) {
+    names.push_back(otherNames[i]);
+    values.push_back(others[i]);
+  }
+  
+  snapBuffer b;
+  int n = 0;
+  for (i=0; i < (int)values.size(); i++)
+    if (values[i] != 0) n++;
+  b.put32(n);
+  for (i=0; i < (int)values.size(); i++) {
+    if (values[i] == 0) continue;
+    b.put32(names[i].size());
+    b.put(names[i].data(), names[i].size());
+    b.put64(values[i]);
+  }
+  out.record(REC_COUNTERS, b);
+}
+
+// **************************************************************** //
+// Print array contents
+
+void printArray(short int array[], int len) {
+  int i;
+  for (i=0; i < len; i++)
+    std::cout << array[i] << ",";
+  std::cout << "\n";
+}
+
+// **************************************************************** //
+//                Setup memory and run simulation
+// **************************************************************** //
+
+void Soup::run() {
   int numAlive, iters;
-  for (iters=0; iters <= SIMSTEPS; iters++) {
+  countInto guard(counts);
+  counts.last = std::chrono::steady_clock::now();
+  for (iters=step; iters <= cfg.simSteps; iters++) {
+    step = iters;
+    
+    // ending early (islands may yet get migrants)
+    if (cfg.stopExtinct && inbox == NULL && CPUs->isEmpty()) break;
+    if (cfg.stallSteps > 0 && iters - lastBirth >= cfg.stallSteps) break;
+    
+    // recording or checking the state
+    if (trace != NULL && iters % cfg.traceTime == 0) {
+      snapBuffer b;
+      traceRecord(b);
+      trace->trace(b);
+      // islands carry on, the others would wait for their migrants
+      if (!trace->matching && inbox == NULL) break;
+    }
+    
+    // statistics, a report of their own
+    if (cfg.statsTime > 0 && iters % cfg.statsTime == 0) {
+      printStats();
+      out.flush();
+    }
   
     // printing interesting info
-    if (iters % PRINTINFOTIME == 0) {
-      std::cout << "\n########################################\n";
-      std::cout << "GLOBAL STEP " << iters << "\n";
-      //std::cout << "Active: " << numAlive << "\n";
+    if (iters % cfg.printInfoTime == 0) {
+      snapBuffer b;
+      b.put32(iters);
+      out.record(REC_STEP, b);
+      //out << "Active: " << numAlive << "\n";
       printCPUInfo();
+      printGenotypes();
+#ifdef COUNTERS
+      printCounters();
+#endif
       printMemory();
+      out.flush();
     }
+    TIME(timeReport);
     numAlive = 0;
     // executing machines
-    node<Machine*>* current = CPUs->getHead();
-    while (current != NULL && numAlive < MAXALIVE) {
-      Machine* m = current->val;
-      assert(m != NULL);
+    unsigned current = CPUs->first();
+    if (sched != NULL) {
+      numAlive = sched->runSlice();
+      current = CPUs->end();
+    }
+    while (current != CPUs->end() && numAlive < cfg.maxAlive) {
       // execute CPU
       numAlive++;
-      //std::cout << "\n**********\n";
-      //std::cout << "\nEcecuting CPU " << m << "\n";
-      int i; bool error = false;
-      for (i=0; i < STEPSPERCYCLE; i++) {
-        /*std::cout << "IP: " << m->IP << "\n";
-        std::cout << "Instruction: " << (int)memory[m->IP] << "\n";
-        std::cout << "Datastack: "; m->dataStack->printStack();
-        std::cout << "Loopstack: "; m->loopStack->printStack();
-        std::cout << "Registers: "; printArray(m->reg, NREGS);*/
-        
-        assert(m->IP >= 0 && m->IP < MEMSIZE);
-        if (execute(m)) error = true;
-        assert(m->IP >= 0 && m->IP < MEMSIZE);
-        
-        m->IP++;
-        if (m->IP >= MEMSIZE) m->IP -= MEMSIZE;
-        
-        // if an error occured, ie execute returned non-zero
-        // promote in CPUs queue (so killed earlier)
-        // and reduce steps left
-        if (error) {
-          CPUs->promote(current);
-          i += ERRORSTEPS;
-        }
-      }
-      current = current->next;
+      //out << "\n**********\n";
+      //out << "\nEcecuting CPU " << (*CPUs)[current] << "\n";
+      (this->*runReal)(current, NULL);
+      current++;
     }
+    TIME(timeExecute);
     
     // freeing memory when not much free or too many Machines
-    while (memAvailable() < (MEMSIZE*MINFREEMEM) || numAlive >= MAXALIVE) {
+    while (memAvailable() < (memSize*cfg.minFreeMem) || 
+           numAlive >= cfg.maxAlive) {
       killCPU();
       numAlive--;
+      COUNT(reaped);
+    }
+    TIME(timeReaper);
+    
+    // swapping genomes with the neighbouring islands
+    if (inbox != NULL && iters > 0 && iters % cfg.migrateTime == 0) {
+      emigrate();
+      immigrate();
+    }
+    TIME(timeMigrate);
+    
+    // every island saves after the same step, so genomes in flight
+    // between islands are sent again after a restore
+    if (!snapName.empty() && cfg.checkpointTime > 0 && iters > 0 && 
+        iters % cfg.checkpointTime == 0) {
+      step = iters+1;
+      checkpoint();
+    }
+    TIME(timeSave);
+  }
+  step = iters;
+}
+
+// **************************************************************** //
+// Run parameters from the command line or a config file
+
+// Set the parameter called name (as the #define at the top) of cfg from
+// text, false if there is no such parameter or value isn't a number
+bool setOption(Config& cfg, const std::string& name, 
+               const std::string& value) {
+  struct { const char* name; int* value; } ints[] = {
+    { "MEMSIZE",        &cfg.memSize },
+    { "MAXALIVE",       &cfg.maxAlive },
+    { "MINSIZE",        &cfg.minSize },
+    { "MAXSIZE",        &cfg.maxSize },
+    { "MALFIT",         &cfg.malFit },
+    { "LOOPSTACKSIZE",  &cfg.loopStackSize },
+    { "DATASTACKSIZE",  &cfg.dataStackSize },
+    { "NREGS",          &cfg.nRegs },
+    { "SIMSTEPS",       &cfg.simSteps },
+    { "PRINTINFOTIME",  &cfg.printInfoTime },
+    { "STEPSPERCYCLE",  &cfg.stepsPerCycle },
+    { "ERRORSTEPS",     &cfg.errorSteps },
+    { "MUTCHANCE",      &cfg.mutChance },
+    { "ERRORCHANCE",    &cfg.errorChance },
+    { "ISLANDS",        &cfg.islands },
+    { "MIGRATETIME",    &cfg.migrateTime },
+    { "MIGRANTS",       &cfg.migrants },
+    { "MIGRATETRIES",   &cfg.migrateTries },
+    { "THREADS",        &cfg.threads },
+    { "LOCKSTEP",       &cfg.lockstep },
+    { "CHECKPOINTTIME", &cfg.checkpointTime },
+    { "STOPEXTINCT",    &cfg.stopExtinct },
+    { "STALLSTEPS",     &cfg.stallSteps },
+    { "SWEEPTHREADS",   &cfg.sweepThreads },
+    { "FORKSTEP",       &cfg.forkStep },
+    { "OUTPUT",         &cfg.output },
+    { "WRITEPOLICY",    &cfg.writePolicy },
+    { "PHYLOGENY",      &cfg.phylogeny },
+    { "TRACE",          &cfg.trace },
+    { "TRACETIME",      &cfg.traceTime },
+    { "STATSTIME",      &cfg.statsTime },
+    { "SEED",           &cfg.seed },
+    { "RESUME",         &cfg.resume }
+  };
+  const char* text = value.c_str();
+  char* end;
+  if (name == "MINFREEMEM") {
+    cfg.minFreeMem = strtod(text, &end);
+    return end != text && *end == '\0';
+  }
+  int i;
+  for (i=0; i < (int)(sizeof(ints) / sizeof(ints[0])); i++) {
+    if (name != ints[i].name) continue;
+    *ints[i].value = strtol(text, &end, 10);
+    return end != text && *end == '\0';
+  }
+  return false;
+}
+// Read a config file of NAME=value (or NAME value) lines,
+// # starts a comment
+bool readConfig(const char* file) {
+  std::ifstream f(file);
+  if (!f) {
+    std::cerr << "Can't read " << file << "\n";
+    return false;
+  }
+  std::string line;
+  int num = 0;
+  while (std::getline(f, line)) {
+    num++;
+    size_t i = line.find('#');
+    if (i != std::string::npos) line.erase(i);
+    for (i=0; i < line.size(); i++)
+      if (line[i] == '=') line[i] = ' ';
+    std::istringstream words(line);
+    std::string name, value, extra;
+    if (!(words >> name)) continue;
+    if (!(words >> value) || (words >> extra) || 
+        !setOption(cfg, name, value)) {
+      std::cerr << file << ":" << num << ": bad setting\n";
+      return false;
+    }
+    cfgGiven.insert(name);
+  }
+  return true;
+}
+// Check the parameters of cfg fit together, saying why not
+bool checkConfig(const Config& cfg) {
+#define REQUIRE(x, msg) \
+  if (!(x)) { \
+    std::cerr << msg << "\n"; \
+    return false; \
+  }
+  REQUIRE(cfg.minSize >= 1 && cfg.minSize <= cfg.maxSize && 
+          cfg.maxSize <= MAXGENOME, 
+          "Program size must be within 1-" << MAXGENOME);
+  REQUIRE(cfg.maxSize >= PRIMEVALSIZE,
+          "MAXSIZE must be at least " << PRIMEVALSIZE << 
+          ", the size of the seed Machine");
+  REQUIRE(cfg.memSize >= 2*cfg.maxSize,
+          "Memory size must be at least " << 2*cfg.maxSize);
+  REQUIRE(cfg.maxAlive >= 1 && cfg.maxAlive <= MAXMACHINES, 
+          "MAXALIVE must be within 1-" << MAXMACHINES);
+  REQUIRE(cfg.malFit == 0 || cfg.malFit == 1, "MALFIT must be 0 or 1");
+  REQUIRE(cfg.minFreeMem >= 0 && cfg.minFreeMem < 1, 
+          "MINFREEMEM must be within 0-1");
+  REQUIRE(cfg.loopStackSize >= 1 && cfg.loopStackSize <= MAXSTACK &&
+          cfg.dataStackSize >= 1 && cfg.dataStackSize <= MAXSTACK,
+          "Stack sizes must be within 1-" << MAXSTACK);
+  REQUIRE(cfg.nRegs >= 1 && cfg.nRegs <= MAXREGS,
+          "Number of registers must be within 1-" << MAXREGS);
+  REQUIRE(cfg.simSteps >= 0 && cfg.printInfoTime >= 1 && 
+          cfg.stepsPerCycle >= 1 && cfg.errorSteps >= 0,
+          "Bad step counts");
+  REQUIRE(cfg.mutChance >= 1 && cfg.errorChance >= 1,
+          "Fault chances must be at least 1");
+  REQUIRE(cfg.islands >= 1, "Number of islands must be at least 1");
+  REQUIRE(cfg.migrateTime >= 1 && cfg.migrants >= 0 && 
+          2*cfg.migrants <= MIGRATEQUEUE && cfg.migrateTries >= 1,
+          "Bad migration settings (at most " << MIGRATEQUEUE/2 << 
+          " migrants)");
+  REQUIRE(cfg.threads >= 1, "Number of threads must be at least 1");
+  REQUIRE(cfg.lockstep == 0 || cfg.lockstep == 1, "LOCKSTEP must be 0 or 1");
+  REQUIRE(cfg.checkpointTime >= 0, "CHECKPOINTTIME must be at least 0");
+  REQUIRE((cfg.stopExtinct == 0 || cfg.stopExtinct == 1) && 
+          cfg.stallSteps >= 0 && cfg.sweepThreads >= 0 && 
+          cfg.forkStep >= 0,
+          "STOPEXTINCT must be 0 or 1, STALLSTEPS, SWEEPTHREADS and " <<
+          "FORKSTEP at least 0");
+  REQUIRE(cfg.output == 0 || cfg.output == 1, "OUTPUT must be 0 or 1");
+  REQUIRE(cfg.writePolicy >= 0 && cfg.writePolicy <= 3, 
+          "WRITEPOLICY must be within 0-3");
+  REQUIRE(cfg.phylogeny == 0 || cfg.phylogeny == 1, 
+          "PHYLOGENY must be 0 or 1");
+  REQUIRE(cfg.trace >= 0 && cfg.trace <= 2 && cfg.traceTime >= 1,
+          "TRACE must be within 0-2 and TRACETIME at least 1");
+  REQUIRE(cfg.statsTime >= 0, "STATSTIME must be at least 0");
+#undef REQUIRE
+  return true;
+}
+
+// **************************************************************** //
+// Parameter sweeps
+// A sweep file is a config file in which settings may have several
+// values (MUTCHANCE = 1000 2000 4000), or a range (SEED = 1-100), every
+// combination of them is a run, the last setting varying fastest. Each
+// run is a Soup of its own with its own settings, one island on one
+// thread, reporting nowhere, ending early when no Machines are left.
+// Threads take the next run not yet started until there are none left,
+// so long and short runs even out, and each run adds a line to
+// sweep.csv as it finishes: run number, the value of each swept
+// setting, steps run, why it ended (done, extinct or stalled, see
+// STALLSTEPS), Machines alive, genotypes seen and alive, births, the
+// most abundant genotype and its number alive, and seconds taken.
+// With FORKSTEP the base settings first run to that step, and every run
+// branches from there (see fork()) instead of starting from nothing.
+// The base's SEED, MUTCHANCE and ERRORCHANCE must be given (they are
+// added to each line), so the shared state can be run again. Runs whose
+// seed or fault chances differ from the base's reseed their branch,
+// others carry on exactly as the base run would have.
+
+#define MAXRUNS 1000000
+
+// a swept setting and its values
+struct sweepAxis {
+  std::string name;
+  std::vector<std::string> values;
+};
+
+// Read a sweep file, settings with one value go into base
+bool readSweep(const char* file, Config& base, 
+               std::vector<sweepAxis>& axes) {
+  std::ifstream f(file);
+  if (!f) {
+    std::cerr << "Can't read " << file << "\n";
+    return false;
+  }
+  std::string line;
+  int num = 0;
+  while (std::getline(f, line)) {
+    num++;
+    size_t i = line.find('#');
+    if (i != std::string::npos) line.erase(i);
+    for (i=0; i < line.size(); i++)
+      if (line[i] == '=' || line[i] == ',') line[i] = ' ';
+    std::istringstream words(line);
+    sweepAxis a;
+    if (!(words >> a.name)) continue;
+    std::string value;
+    bool ok = true;
+    while (ok && words >> value) {
+      // first-last for every integer in between
+      size_t dash = value.find('-', 1);
+      if (dash == std::string::npos) {
+        a.values.push_back(value);
+        continue;
+      }
+      char* end1;
+      char* end2;
+      long first = strtol(value.c_str(), &end1, 10);
+      long last = strtol(value.c_str() + dash+1, &end2, 10);
+      ok = end1 == value.c_str() + dash && *end2 == '\0' && 
+           first <= last && last - first < MAXRUNS;
+      long v;
+      for (v=first; ok && v <= last; v++) {
+        std::ostringstream text;
+        text << v;
+        a.values.push_back(text.str());
+      }
     }
+    Config scratch = base;
+    for (i=0; ok && i < a.values.size(); i++)
+      ok = setOption(scratch, a.name, a.values[i]);
+    if (!ok || a.values.empty()) {
+      std::cerr << file << ":" << num << ": bad setting\n";
+      return false;
+    }
+    if (a.values.size() > 1) {
+      axes.push_back(a);
+      continue;
+    }
+    setOption(base, a.name, a.values[0]);
+    cfgGiven.insert(a.name);
+  }
+  return true;
+}
+
+class Sweep {
+  private:
+    Config base;
+    std::vector<sweepAxis> axes;
+    long long numRuns;
+    
+    // next run to start, and the summary (under lock)
+    std::atomic<long long> nextRun;
+    std::mutex lock;
+    std::ofstream summary;
+    
+    // snapshot the runs branch from (see FORKSTEP), -1 for none
+    int forkFd;
+    
+    const std::string& value(long long run, int i);
+    Config single(Config c);
+    Config runConfig(long long run);
+    void runOne(long long run);
+    void worker();
+  public:
+    Sweep(const Config& c, const std::vector<sweepAxis>& a);
+    bool check();
+    bool run(const char* file);
+};
+
+Sweep::Sweep(const Config& c, const std::vector<sweepAxis>& a) : 
+    base(c), axes(a) {
+  numRuns = 1;
+  int i;
+  for (i=0; i < (int)axes.size() && numRuns <= MAXRUNS; i++)
+    numRuns *= axes[i].values.size();
+  nextRun = 0;
+  forkFd = -1;
+}
+
+// Value of swept setting i in run number run
+const std::string& Sweep::value(long long run, int i) {
+  int k;
+  for (k=axes.size()-1; k > i; k--)
+    run /= axes[k].values.size();
+  return axes[i].values[run % axes[i].values.size()];
+}
+
+// Settings of run number run
+Config Sweep::runConfig(long long run) {
+  Config c = base;
+  int i;
+  for (i=0; i < (int)axes.size(); i++)
+    setOption(c, axes[i].name, value(run, i));
+  return single(c);
+}
+// c as a run of a sweep: one island on one thread, writing nothing
+Config Sweep::single(Config c) {
+  c.islands = 1;
+  c.threads = 1;
+  c.checkpointTime = 0;
+  c.phylogeny = 0;
+  c.trace = 0;
+  c.resume = 0;
+  c.output = 0;
+  // reporting nowhere, from the run's own thread
+  c.writePolicy = 0;
+  c.stopExtinct = 1;
+  // only the info at step 0
+  c.printInfoTime = c.simSteps + 1;
+  return c;
+}
+
+// Check every run's settings before any starts, saying which is wrong
+bool Sweep::check() {
+  if (numRuns > MAXRUNS) {
+    std::cerr << "More than " << MAXRUNS << " runs in the sweep\n";
+    return false;
+  }
+  // branches must fit the snapshot they start from
+  const char* fixed[] = { "MEMSIZE", "NREGS", "DATASTACKSIZE", 
+                          "LOOPSTACKSIZE", "FORKSTEP" };
+  int i, j;
+  for (i=0; base.forkStep > 0 && i < (int)axes.size(); i++)
+    for (j=0; j < (int)(sizeof(fixed) / sizeof(fixed[0])); j++)
+      if (axes[i].name == fixed[j]) {
+        std::cerr << fixed[j] << " can't be swept with FORKSTEP\n";
+        return false;
+      }
+  // the state every branch starts from must be one that can be run again
+  const char* reseeding[] = { "SEED", "MUTCHANCE", "ERRORCHANCE" };
+  for (i=0; base.forkStep > 0 && 
+            i < (int)(sizeof(reseeding) / sizeof(reseeding[0])); i++)
+    if (cfgGiven.count(reseeding[i]) == 0) {
+      std::cerr << "FORKSTEP needs a " << reseeding[i] << 
+        " for the base run\n";
+      return false;
+    }
+  long long run;
+  for (run=0; run < numRuns; run++) {
+    if (checkConfig(runConfig(run))) continue;
+    std::cerr << "(in run " << run << ")\n";
+    return false;
+  }
+  return true;
+}
+
+void Sweep::runOne(long long run) {
+  Config c = runConfig(run);
+  std::chrono::steady_clock::time_point start = 
+    std::chrono::steady_clock::now();
+  std::ostream nowhere(NULL);
+  Reporter out(nowhere, 0, c);
+  Soup soup(c.memSize, out, c);
+  soup.setThreads(1);
+  if (forkFd < 0) {
+    soup.initialise(c.seed);
+  } else if (!soup.restore(forkFd)) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cerr << "Run " << run << " can't branch from step " << 
+      base.forkStep << "\n";
+    return;
+  } else if (c.seed != base.seed || c.mutChance != base.mutChance ||
+             c.errorChance != base.errorChance) {
+    soup.reseed(c.seed);
+  }
+  soup.run();
+  std::chrono::duration<double> took = 
+    std::chrono::steady_clock::now() - start;
+  
+  int alive = soup.CPUs->size();
+  long long births = soup.genes.born();
+  int live = 0, top = -1;
+  int i;
+  for (i=0; i < soup.genes.size(); i++) {
+    genotype& g = soup.genes[i];
+    if (g.live > 0) live++;
+    if (g.live > 0 && (top < 0 || g.live > soup.genes[top].live)) top = i;
+  }
+  
+  std::ostringstream line;
+  line << run;
+  for (i=0; i < (int)axes.size(); i++)
+    line << "," << value(run, i);
+  line << "," << soup.step << ",";
+  if (alive == 0) line << "extinct";
+  else if (soup.step <= c.simSteps) line << "stalled";
+  else line << "done";
+  line << "," << alive << "," << soup.genes.seen() << "," << live;
+  line << "," << births << ",";
+  if (top >= 0) {
+    formatGenotype(soup.genes[top].size, soup.genes[top].label, line);
+    line << "," << soup.genes[top].live;
+  } else {
+    line << "-,0";
+  }
+  line << "," << std::fixed << std::setprecision(3) << took.count();
+  if (forkFd >= 0)
+    line << "," << base.forkStep << "," << base.seed << "," << 
+      base.mutChance << "," << base.errorChance;
+  line << "\n";
+  
+  std::lock_guard<std::mutex> guard(lock);
+  summary << line.str();
+  summary.flush();
+}
+
+void Sweep::worker() {
+  // what runs count outside Soup::run, kept apart from other threads'
+  counters own = counters();
+  countInto guard(own);
+  long long run;
+  while ((run = nextRun++) < numRuns)
+    runOne(run);
+}
+
+// Run the sweep on SWEEPTHREADS threads, summary to file
+bool Sweep::run(const char* file) {
+  summary.open(file);
+  if (!summary) {
+    std::cerr << "Can't write " << file << "\n";
+    return false;
+  }
+  summary << "run";
+  int i;
+  for (i=0; i < (int)axes.size(); i++)
+    summary << "," << axes[i].name;
+  summary << ",steps,end,alive,genotypes,live_genotypes,births,";
+  summary << "top_genotype,top_alive,seconds";
+  if (base.forkStep > 0) 
+    summary << ",fork_step,fork_seed,fork_mutchance,fork_errorchance";
+  summary << "\n";
+  
+  int numThreads = base.sweepThreads;
+  if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > numRuns) numThreads = numRuns;
+  
+  if (base.forkStep > 0) {
+    std::cout << "Running to step " << base.forkStep << " to branch (SEED=" 
+      << base.seed << " MUTCHANCE=" << base.mutChance << " ERRORCHANCE=" 
+      << base.errorChance << ")\n";
+    Config c = single(base);
+    c.simSteps = base.forkStep - 1;
+    c.printInfoTime = base.forkStep;
+    std::ostream nowhere(NULL);
+    Reporter out(nowhere, 0, c);
+    Soup soup(c.memSize, out, c);
+    soup.setThreads(1);
+    soup.initialise(c.seed);
+    soup.run();
+    forkFd = soup.fork();
+    if (forkFd < 0) {
+      std::cerr << "Can't branch from step " << soup.step << "\n";
+      return false;
+    }
+  }
+  
+  std::cout << numRuns << " runs on " << numThreads << " threads\n";
+  std::vector<std::thread> threads;
+  for (i=1; i < numThreads; i++)
+    threads.push_back(std::thread(&Sweep::worker, this));
+  worker();
+  for (i=0; i < (int)threads.size(); i++)
+    threads[i].join();
+  if (forkFd >= 0) close(forkFd);
+  return true;
+}
+
+// left out when the file is included by Bench.cpp
+#ifndef NOMAIN
+int main(int argc, char** argv) {
+  // arguments are NAME=value settings, -f file to read settings from,
+  // -s sweep file to run a sweep (see Sweep), or as before memory size,
+  // seed, islands, threads and resume in order
+  const char* positional[] = { "MEMSIZE", "SEED", "ISLANDS", "THREADS", 
+                               "RESUME" };
+  int numPositional = 0;
+  bool sweeping = false;
+  std::vector<sweepAxis> axes;
+  cfg.seed = time(NULL);
+  int i;
+  for (i=1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    bool ok;
+    if (arg == "-f" && i+1 < argc) {
+      if (!readConfig(argv[++i])) return 1;
+      continue;
+    } else if (arg == "-s" && i+1 < argc) {
+      if (!readSweep(argv[++i], cfg, axes)) return 1;
+      sweeping = true;
+      continue;
+    } else if (eq != std::string::npos) {
+      ok = setOption(cfg, arg.substr(0, eq), arg.substr(eq+1));
+      cfgGiven.insert(arg.substr(0, eq));
+    } else if (numPositional < 5) {
+      cfgGiven.insert(positional[numPositional]);
+      ok = setOption(cfg, positional[numPositional++], arg);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Bad argument " << arg << "\n";
+      return 1;
+    }
+  }
+  if (!checkConfig(cfg)) return 1;
+  if (sweeping) {
+    Sweep sweep(cfg, axes);
+    if (!sweep.check() || !sweep.run("sweep.csv")) return 1;
+    return 0;
+  }
+  int memSize = cfg.memSize;
+  int seed = cfg.seed;
+  int numIslands = cfg.islands;
+  int numThreads = cfg.threads;
+  bool resume = cfg.resume != 0;
+  
+  // one Soup per island, printing to out.txt, logging to phylo.bin and
+  // saving to checkpoint.bin, or to out0.txt, phylo0.bin, checkpoint0.bin...
+  // when there are several
+  std::vector<std::ofstream*> outs;
+  std::vector<Reporter*> reporters;
+  std::vector<PhyloLog*> phylos;
+  std::vector<StateTrace*> traces;
+  std::vector<Soup*> soups;
+  std::vector<migrationQueue*> queues;
+  int k;
+  for (k=0; k < numIslands; k++) {
+    std::ostringstream name, snap, phylo;
+    const char* ext = cfg.output == 1 ? ".bin" : ".txt";
+    std::ios::openmode mode = std::ios::out;
+    if (cfg.output == 1) mode |= std::ios::binary;
+    if (numIslands == 1) {
+      name << "out" << ext;
+      snap << "checkpoint.bin";
+      phylo << "phylo.bin";
+    } else {
+      name << "out" << k << ext;
+      snap << "checkpoint" << k << ".bin";
+      phylo << "phylo" << k << ".bin";
+    }
+    long long outPos = 0, phyloPos = 0;
+    if (resume) {
+      // out and the log go back to how they were at the snapshot
+      // and carry on
+      if (!snapshotInfo(snap.str().c_str(), memSize, outPos, phyloPos) || 
+          truncate(name.str().c_str(), outPos) != 0 ||
+          (cfg.phylogeny && phyloPos > 0 && 
+           truncate(phylo.str().c_str(), phyloPos) != 0)) {
+        std::cerr << "Can't resume from " << snap.str() << "\n";
+        return 1;
+      }
+      outs.push_back(new std::ofstream(name.str().c_str(), 
+                                       mode | std::ios::app));
+    } else {
+      outs.push_back(new std::ofstream(name.str().c_str(), mode));
+    }
+    reporters.push_back(new Reporter(*outs[k], outPos, cfg));
+    soups.push_back(new Soup(memSize, *reporters[k], cfg));
+    soups[k]->setThreads(numThreads);
+    soups[k]->snapName = snap.str();
+    if (cfg.phylogeny) {
+      phylos.push_back(new PhyloLog(phylo.str(), phyloPos));
+      if (!phylos.back()->ok()) {
+        std::cerr << "Can't write " << phylo.str() << "\n";
+        return 1;
+      }
+      soups[k]->phylo = phylos.back();
+    }
+  }
+  // islands form a ring, each sending to the next
+  if (numIslands > 1) {
+    for (k=0; k < numIslands; k++) {
+      queues.push_back(new migrationQueue());
+      soups[k]->outbox = queues[k];
+      soups[(k+1) % numIslands]->inbox = queues[k];
+    }
+  }
+  
+  for (k=0; k < numIslands; k++) {
+    if (resume) {
+      if (!soups[k]->restore(soups[k]->snapName.c_str())) {
+        std::cerr << "Can't resume from " << soups[k]->snapName << "\n";
+        return 1;
+      }
+      continue;
+    }
+    std::ostringstream out;
+    // print general information
+    out << "Settings:\n";
+    out << "  Memory size     : " << memSize << "\n";
+    out << "  Simulation steps: " << cfg.simSteps << "\n";
+    out << "  Print intervals : " << cfg.printInfoTime << "\n";
+    out << "  Min free % mem  : " << cfg.minFreeMem << "\n";
+    out << "\n";
+    out << "  Max programs    : " << cfg.maxAlive << "\n";
+    out << "  Program size    : " << cfg.minSize << "-" << cfg.maxSize << "\n";
+    out << "  Iterations/step : " << cfg.stepsPerCycle << "\n";
+    out << "  Iter lost/error : " << cfg.errorSteps << "\n";
+    out << "  Loopstack size  : " << cfg.loopStackSize << "\n";
+    out << "  Datastack size  : " << cfg.dataStackSize << "\n";
+    out << "  Number registers: " << cfg.nRegs << "\n";
+    out << "\n";
+    out << "  Copy fault chance     : 1/" << cfg.mutChance << "\n";
+    out << "  Execution fault chance: 1/" << cfg.errorChance << "\n";
+    out << "\n";
+    if (numIslands > 1) {
+      out << "  Island          : " << k << " of " << numIslands << "\n";
+      out << "  Migration       : " << cfg.migrants << " every ";
+      out << cfg.migrateTime;
+      out << " steps\n";
+      out << "\n";
+    }
+    // add primeval, island k seeded with SEED (by default the time) + k
+    out << "  Seed: " << seed + k << "\n";
+    snapBuffer b;
+    b.put(out.str().data(), out.str().size());
+    reporters[k]->record(REC_TEXT, b);
+    reporters[k]->flush();
+    soups[k]->initialise(seed + k);
+  }
+  
+  // state traces, from the step each Soup starts at
+  for (k=0; k < numIslands && cfg.trace != 0; k++) {
+    std::ostringstream name;
+    if (numIslands == 1) name << "trace.bin";
+    else name << "trace" << k << ".bin";
+    traces.push_back(new StateTrace(name.str(), soups[k]->cfg, 
+                                    soups[k]->memSize, soups[k]->step));
+    if (!traces[k]->ok()) {
+      std::cerr << "Can't use " << name.str() << " as a trace";
+      std::cerr << " (of this memory size and TRACETIME)\n";
+      return 1;
+    }
+    soups[k]->trace = traces[k];
+  }
+  
+  if (numIslands == 1) {
+    soups[0]->run();
+  } else {
+    std::vector<std::thread> threads;
+    for (k=0; k < numIslands; k++)
+      threads.push_back(std::thread(&Soup::run, soups[k]));
+    for (k=0; k < numIslands; k++)
+      threads[k].join();
+  }
+  
+  for (k=0; k < numIslands; k++) {
+    delete soups[k];
+    delete reporters[k];
+    delete outs[k];
+  }
+  for (k=0; k < (int)phylos.size(); k++)
+    delete phylos[k];
+  for (k=0; k < (int)queues.size(); k++)
+    delete queues[k];
+  // a run that differs from its trace fails
+  bool matching = true;
+  for (k=0; k < (int)traces.size(); k++) {
+    if (!traces[k]->matching) matching = false;
+    delete traces[k];
   }
+  if (!matching) return 2;
   // finish without error
   return 0;
 }
+#endif
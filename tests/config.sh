@@ -0,0 +1,49 @@
+#!/bin/sh
+# Regression runs of settings that once crashed the simulation, built by
+# make check
+#
+# usage: tests/config.sh [simulation (default ./Simulation.o)]
+#
+# Each case runs in a scratch directory and must end with the status
+# given: 1 for settings checkConfig() rejects, 0 for ones it accepts.
+
+SIM=$(cd "$(dirname "${1:-./Simulation.o}")" && pwd)/$(basename "${1:-./Simulation.o}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failed=0
+
+# expect status settings...
+expect() {
+  want=$1
+  shift
+  "$SIM" "$@" > log.txt 2>&1
+  got=$?
+  if [ $got -eq $want ]; then
+    echo "ok    $*"
+  else
+    echo "FAIL  $* (status $got, not $want)"
+    sed 's/^/      /' log.txt | tail -5
+    failed=1
+  fi
+}
+
+# memory and programs smaller than the seed Machine (136 cells), which
+# wrote past memory and aborted in ExtentMap::insert
+expect 1 MEMSIZE=40 MAXSIZE=20 MINSIZE=12 SIMSTEPS=10
+# programs smaller than the seed Machine, which overflowed printCPUInfo
+expect 1 MAXSIZE=100 SIMSTEPS=10
+# the smallest memory and programs that fit it
+expect 0 MEMSIZE=272 MAXSIZE=136 SIMSTEPS=2000 SEED=1
+# more Machines than the pool holds
+expect 1 MAXALIVE=2000000 SIMSTEPS=10
+# resumed with a MAXSIZE under Machines in the snapshot, which wrote
+# past printCPUInfo's counts (seen with a -fsanitize=address build)
+expect 0 SEED=1 SIMSTEPS=20000 CHECKPOINTTIME=10000
+expect 0 SEED=1 SIMSTEPS=21000 PRINTINFOTIME=100 RESUME=1 MAXSIZE=140
+if ! grep -Eq "Size (14[1-9]|1[5-9][0-9]|[2-9][0-9][0-9])" out.txt; then
+  echo "FAIL  no Machine over MAXSIZE=140 after resuming"
+  failed=1
+fi
+
+exit $failed